@@ -23,13 +23,14 @@ enum {
     STRUCT_ROOM_COUNT
 };
 
-typedef void (*event_action_t)(void *ctx, uint16_t value);
+typedef void (*event_action_t)(void *ctx, uint32_t value);
 
 struct Event {
     void *fifo_reserved;
     event_action_t action;
     void *ctx;
-    uint16_t value;
+    uint32_t value;
+    uint32_t input_cycles;    // k_cycle_get_32() of the switch edge behind it
 };
 
 struct Room {
@@ -40,16 +41,16 @@ struct Room {
     const struct gpio_dt_spec* light_switch;
     const struct pwm_dt_spec* light_pwm;
     const struct gpio_dt_spec* light_gpio;
-    uint16_t light_value;
+    uint32_t light_value;
 
     /* TODO Heat */
     /* Temperature sensor */
     /* Temperature gpio */
 };
 
-void gpio_event_action(void *ctx, uint16_t value);
+void gpio_event_action(void *ctx, uint32_t value);
 
-void pwm_event_action(void *ctx, uint16_t value);
+void pwm_event_action(void *ctx, uint32_t value);
 
 bool room_device_init();
 
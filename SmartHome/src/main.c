@@ -8,6 +8,7 @@
 #include "Room.h"
 
 #define SLEEP_TIME_MS 200
+#define DEBOUNCE_MS 20
 #define STACKSIZE 1024
 #define PRIORITY 7
 
@@ -18,43 +19,94 @@ void log_msg(const char* fmt, ...) {
     va_end(args);
 }
 
-void listening_events_thread(void) {
+/* Wall switches raise an interrupt on both edges and every edge restarts the
+ * debounce work. The light follows the switch once the contact has been
+ * stable for DEBOUNCE_MS.
+ */
+struct light_switch {
+    struct gpio_callback cb;
+    struct k_work_delayable debounce;
+    struct Room *room;
+    atomic_t press_cycles;    // First edge of a bounce burst, 0 when idle
+};
+
+static struct light_switch light_switches[STRUCT_ROOM_COUNT];
+
+static void light_switch_isr(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins) {
+    struct light_switch *sw = CONTAINER_OF(cb, struct light_switch, cb);
+
+    // The low bit is forced so a real timestamp is never mistaken for idle
+    atomic_cas(&sw->press_cycles, 0, (atomic_val_t)(k_cycle_get_32() | 1));
+    k_work_reschedule(&sw->debounce, K_MSEC(DEBOUNCE_MS));
+}
+
+static void light_switch_debounced(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct light_switch *sw = CONTAINER_OF(dwork, struct light_switch, debounce);
+    struct Room *room = sw->room;
+    uint32_t press_cycles = (uint32_t)atomic_clear(&sw->press_cycles);
+    int percentage_ = 50;
+
+    int level = gpio_pin_get_dt(room->light_switch);
+    if (level < 0) {
+        printk("Reading switch failed: %d\n", level);
+        return;
+    }
+
+    // PWM light needs special value so I calculated it here
+    uint32_t new_value = level;
+    if (room->light_pwm != NULL && level) {
+        new_value = room->light_pwm->period * percentage_ / 100;
+    }
+    if (new_value == room->light_value) {
+        // Bounced back to where it was
+        return;
+    }
+
+    struct Event *new_event = k_malloc(sizeof(struct Event));
+    if (!new_event) {
+        printk("Unable to allocate memory for event\n");
+        return;
+    }
+
+    /* Register light events */
+    if (room->light_gpio != NULL) {
+        new_event->action = gpio_event_action;
+        new_event->ctx = (void *)room->light_gpio;
+    } else {
+        new_event->action = pwm_event_action;
+        new_event->ctx = (void *)room->light_pwm;
+    }
+    new_event->value = new_value;
+    new_event->input_cycles = press_cycles;
+    room->light_value = new_value;
+
+    // TODO register heat events
+
+    k_fifo_put(&events_fifo, new_event);
+}
 
+static void light_switches_start(void) {
     struct Room **rooms = get_all_rooms();
 
-    while (1) {
-        int percentage_ = 50;
-
-        for (int i = 0; i < STRUCT_ROOM_COUNT; i++) {
-
-            bool new_state = gpio_pin_get_dt(rooms[i]->light_switch);
-
-            struct Event *new_event = k_malloc(sizeof(struct Event));
-            if (!new_event) {
-                printk("Unable to allocate memory for event\n");
-                return;
-            }
-
-            /* Register light events */
-            if (rooms[i]->light_gpio != NULL) {
-                new_event->action = gpio_event_action;
-                new_event->ctx = (void *)rooms[i]->light_gpio;
-                new_event->value = new_state;
-            }
-            if (rooms[i]->light_pwm != NULL) {
-                // PWM light needs special value so I calculated it here
-                new_state = rooms[i]->light_pwm->period * percentage_ / 100;
-                new_event->action = pwm_event_action;
-                new_event->ctx = (void *)rooms[i]->light_pwm;
-                new_event->value = new_state;
-            }
-
-            // TODO register heat events
-
-            k_fifo_put(&events_fifo, new_event);
+    for (int i = 0; i < STRUCT_ROOM_COUNT; i++) {
+        struct light_switch *sw = &light_switches[i];
+        const struct gpio_dt_spec *spec = rooms[i]->light_switch;
+
+        sw->room = rooms[i];
+        k_work_init_delayable(&sw->debounce, light_switch_debounced);
+        gpio_init_callback(&sw->cb, light_switch_isr, BIT(spec->pin));
+
+        int ret = gpio_add_callback_dt(spec, &sw->cb);
+        if (ret == 0) {
+            ret = gpio_pin_interrupt_configure_dt(spec, GPIO_INT_EDGE_BOTH);
+        }
+        if (ret != 0) {
+            printk("Switch interrupt %d failed: %d\n", i, ret);
         }
 
-        k_msleep(SLEEP_TIME_MS);
+        // Pick up the position the switch is in at boot
+        k_work_schedule(&sw->debounce, K_NO_WAIT);
     }
 }
 
@@ -67,9 +119,12 @@ void execut_events_thread(void) {
             registered_event->value
         );
 
-        k_free(registered_event);
+        if (registered_event->input_cycles != 0) {
+            printk("Switch press to light: %u us\n",
+                   k_cyc_to_us_floor32(k_cycle_get_32() - registered_event->input_cycles));
+        }
 
-        k_msleep(SLEEP_TIME_MS);
+        k_free(registered_event);
     }
 }
 
@@ -81,6 +136,8 @@ int main(void)
         return 0;
     }
 
+    light_switches_start();
+
     int ret = 0;
     while (1) {
 
@@ -96,7 +153,5 @@ int main(void)
 }
 
 // --- Thread definitions ---
-K_THREAD_DEFINE(listening_id, STACKSIZE, listening_events_thread, NULL, NULL, NULL,
-                PRIORITY, 0, 0);
 K_THREAD_DEFINE(execut_id, STACKSIZE, execut_events_thread, NULL, NULL, NULL,
                 PRIORITY, 0, 0);
@@ -0,0 +1,587 @@
+#!/usr/bin/env python3
+"""Load test of the SmartHomeWeb HTTP and WebSocket API.
+
+Drives a running SmartHomeWeb target, normally the native_sim build with
+bench.conf, and reports throughput and latency percentiles:
+
+  rooms      GET /api/v1/rooms
+  light      POST /api/v1/light, toggling the lights of every room
+  temp       POST /api/v1/temp, walking the setpoints of every room
+  mixed      the three above drawn at random with the --mix weights
+  ws         N subscribers on /ws, latency from a light POST until each
+             subscriber received the matching update, for every N of
+             --ws-clients
+
+Only the Python 3 standard library is needed. Results are printed as a
+table and, with --output, written as JSON. --baseline compares the run with
+an earlier JSON file and exits with 1 when throughput dropped or p99 latency
+grew by more than --tolerance.
+
+  west build -b native_sim SmartHomeWeb -- -DEXTRA_CONF_FILE=bench.conf
+  sudo net-tools/net-setup.sh &  build/zephyr/zephyr.exe
+  SmartHomeWeb/bench/smarthome_bench.py --output v1.4.json --baseline v1.3.json
+"""
+
+import argparse
+import asyncio
+import base64
+import datetime
+import itertools
+import json
+import os
+import random
+import struct
+import sys
+import time
+
+DEFAULT_HOST = "192.0.2.1"
+DEFAULT_PORT = 80
+REQUEST_TIMEOUT_S = 5.0
+RESULTS_VERSION = 1
+
+
+class HttpError(Exception):
+    pass
+
+
+def percentile(sorted_values, p):
+    """Nearest-rank percentile of an already sorted list, None when empty."""
+    if not sorted_values:
+        return None
+    rank = max(0, min(len(sorted_values) - 1, int(round(p / 100.0 * len(sorted_values) + 0.5)) - 1))
+    return sorted_values[rank]
+
+
+def latency_summary(latencies_s):
+    values = sorted(v * 1000.0 for v in latencies_s)
+    if not values:
+        return {"p50": None, "p90": None, "p99": None, "max": None, "mean": None}
+    return {
+        "p50": round(percentile(values, 50), 3),
+        "p90": round(percentile(values, 90), 3),
+        "p99": round(percentile(values, 99), 3),
+        "max": round(values[-1], 3),
+        "mean": round(sum(values) / len(values), 3),
+    }
+
+
+# --- HTTP/1.1 ---
+
+async def read_headers(reader):
+    status_line = await reader.readline()
+    if not status_line:
+        raise HttpError("connection closed before the status line")
+    parts = status_line.decode("latin-1").split(None, 2)
+    if len(parts) < 2 or not parts[0].startswith("HTTP/"):
+        raise HttpError("bad status line %r" % status_line)
+
+    headers = {}
+    while True:
+        line = await reader.readline()
+        if not line:
+            raise HttpError("connection closed in the headers")
+        if line in (b"\r\n", b"\n"):
+            break
+        name, _, value = line.decode("latin-1").partition(":")
+        headers[name.strip().lower()] = value.strip()
+    return int(parts[1]), headers
+
+
+async def read_body(reader, status, headers):
+    if status in (204, 304) or 100 <= status < 200:
+        return b""
+    if "chunked" in headers.get("transfer-encoding", "").lower():
+        body = bytearray()
+        while True:
+            size_line = await reader.readline()
+            if not size_line:
+                raise HttpError("connection closed in a chunk")
+            size = int(size_line.split(b";")[0].strip() or b"0", 16)
+            if size == 0:
+                while (await reader.readline()) not in (b"\r\n", b"\n", b""):
+                    pass
+                return bytes(body)
+            body += await reader.readexactly(size)
+            await reader.readexactly(2)
+    if "content-length" in headers:
+        return await reader.readexactly(int(headers["content-length"]))
+    return await reader.read()
+
+
+class HttpConnection:
+    """One client socket, reused between requests with --keep-alive."""
+
+    def __init__(self, host, port, keep_alive):
+        self.host = host
+        self.port = port
+        self.keep_alive = keep_alive
+        self.reader = None
+        self.writer = None
+
+    async def close(self):
+        if self.writer is not None:
+            self.writer.close()
+            try:
+                await self.writer.wait_closed()
+            except OSError:
+                pass
+        self.reader = self.writer = None
+
+    async def request(self, method, path, body=None):
+        if self.writer is None:
+            self.reader, self.writer = await asyncio.open_connection(self.host, self.port)
+
+        lines = [
+            "%s %s HTTP/1.1" % (method, path),
+            "Host: %s" % self.host,
+            "Connection: %s" % ("keep-alive" if self.keep_alive else "close"),
+        ]
+        payload = b""
+        if body is not None:
+            payload = json.dumps(body, separators=(",", ":")).encode()
+            lines.append("Content-Type: application/json")
+            lines.append("Content-Length: %d" % len(payload))
+        self.writer.write(("\r\n".join(lines) + "\r\n\r\n").encode() + payload)
+
+        try:
+            await self.writer.drain()
+            status, headers = await read_headers(self.reader)
+            data = await read_body(self.reader, status, headers)
+        except (OSError, asyncio.IncompleteReadError, HttpError):
+            await self.close()
+            raise
+
+        if not self.keep_alive or headers.get("connection", "").lower() == "close":
+            await self.close()
+        return status, data
+
+
+async def http_once(host, port, method, path, body=None):
+    conn = HttpConnection(host, port, keep_alive=False)
+    try:
+        return await asyncio.wait_for(conn.request(method, path, body), REQUEST_TIMEOUT_S)
+    finally:
+        await conn.close()
+
+
+async def fetch_rooms(host, port):
+    status, data = await http_once(host, port, "GET", "/api/v1/rooms")
+    if status != 200:
+        raise HttpError("GET /api/v1/rooms answered %d" % status)
+    rooms = json.loads(data)
+    return rooms if isinstance(rooms, list) else [rooms]
+
+
+# --- Request generators ---
+
+class Workload:
+    """Builds the requests of the HTTP scenarios, shared by all workers."""
+
+    def __init__(self, rooms, mix):
+        self.room_ids = [r["room_id"] for r in rooms] or [0]
+        self.lights = {r["room_id"]: 1 if r.get("light_gpio_value") else 0 for r in rooms}
+        self.setpoints = itertools.count()
+        self.rr = itertools.count()
+        self.mix_names = list(mix)
+        self.mix_weights = [mix[name] for name in self.mix_names]
+
+    def next_room(self):
+        return self.room_ids[next(self.rr) % len(self.room_ids)]
+
+    def rooms(self):
+        return "GET", "/api/v1/rooms", None
+
+    def light(self):
+        # Toggles, so every request is a real state change with an actuator event
+        room_id = self.next_room()
+        self.lights[room_id] = 1 - self.lights.get(room_id, 0)
+        return "POST", "/api/v1/light", {"room_id": room_id, "light_value": self.lights[room_id]}
+
+    def temp(self):
+        # Walks 20.00-23.95 C in 0.05 steps, crossing the heating hysteresis
+        return "POST", "/api/v1/temp", {
+            "room_id": self.next_room(),
+            "setpoint_temp_value": 2000 + (next(self.setpoints) % 80) * 5,
+        }
+
+    def mixed(self):
+        return getattr(self, random.choices(self.mix_names, self.mix_weights)[0])()
+
+
+class HttpStats:
+    def __init__(self):
+        self.latencies = []
+        self.errors = 0
+        self.statuses = {}
+
+    def record(self, status, latency_s):
+        self.statuses[str(status)] = self.statuses.get(str(status), 0) + 1
+        if 200 <= status < 400:
+            self.latencies.append(latency_s)
+        else:
+            self.errors += 1
+
+
+async def http_worker(args, make_request, deadline, stats):
+    conn = HttpConnection(args.host, args.port, args.keep_alive)
+    try:
+        while time.monotonic() < deadline:
+            method, path, body = make_request()
+            start = time.perf_counter()
+            try:
+                status, _ = await asyncio.wait_for(conn.request(method, path, body), REQUEST_TIMEOUT_S)
+            except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, HttpError):
+                await conn.close()
+                stats.errors += 1
+                continue
+            stats.record(status, time.perf_counter() - start)
+    finally:
+        await conn.close()
+
+
+async def run_http_scenario(args, name, make_request, concurrency):
+    stats = HttpStats()
+    start = time.monotonic()
+    deadline = start + args.duration
+    await asyncio.gather(*(http_worker(args, make_request, deadline, stats) for _ in range(concurrency)))
+    elapsed = time.monotonic() - start
+
+    return {
+        "scenario": name,
+        "concurrency": concurrency,
+        "duration_s": round(elapsed, 3),
+        "requests": len(stats.latencies),
+        "errors": stats.errors,
+        "statuses": stats.statuses,
+        "throughput_rps": round(len(stats.latencies) / elapsed, 2) if elapsed > 0 else 0.0,
+        "latency_ms": latency_summary(stats.latencies),
+    }
+
+
+# --- WebSocket ---
+
+WS_OP_TEXT = 0x1
+WS_OP_BINARY = 0x2
+WS_OP_CLOSE = 0x8
+WS_OP_PING = 0x9
+WS_OP_PONG = 0xA
+
+
+def ws_encode_frame(opcode, payload):
+    """Client frames are always masked."""
+    mask = os.urandom(4)
+    header = bytearray([0x80 | opcode])
+    if len(payload) < 126:
+        header.append(0x80 | len(payload))
+    elif len(payload) < 1 << 16:
+        header.append(0x80 | 126)
+        header += struct.pack("!H", len(payload))
+    else:
+        header.append(0x80 | 127)
+        header += struct.pack("!Q", len(payload))
+    masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+    return bytes(header) + mask + masked
+
+
+async def ws_read_frame(reader):
+    b0, b1 = await reader.readexactly(2)
+    length = b1 & 0x7F
+    if length == 126:
+        length = struct.unpack("!H", await reader.readexactly(2))[0]
+    elif length == 127:
+        length = struct.unpack("!Q", await reader.readexactly(8))[0]
+    mask = await reader.readexactly(4) if b1 & 0x80 else None
+    payload = await reader.readexactly(length)
+    if mask:
+        payload = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+    return b0 & 0x0F, payload
+
+
+class WsSubscriber:
+    """Listens on /ws and timestamps the light updates the fan-out test waits for."""
+
+    def __init__(self, index, pending):
+        self.index = index
+        self.pending = pending
+        self.frames = 0
+        self.reader = None
+        self.writer = None
+        self.task = None
+
+    async def connect(self, host, port, path="/ws"):
+        self.reader, self.writer = await asyncio.open_connection(host, port)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.writer.write((
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Key: %s\r\n"
+            "Sec-WebSocket-Version: 13\r\n\r\n" % (path, host, key)).encode())
+        await self.writer.drain()
+        status, _ = await asyncio.wait_for(read_headers(self.reader), REQUEST_TIMEOUT_S)
+        if status != 101:
+            raise HttpError("%s answered %d instead of 101" % (path, status))
+        self.task = asyncio.ensure_future(self.listen())
+
+    async def listen(self):
+        try:
+            while True:
+                opcode, payload = await ws_read_frame(self.reader)
+                now = time.perf_counter()
+                if opcode == WS_OP_PING:
+                    self.writer.write(ws_encode_frame(WS_OP_PONG, payload))
+                elif opcode == WS_OP_CLOSE:
+                    return
+                elif opcode == WS_OP_TEXT:
+                    self.frames += 1
+                    self.on_text(payload, now)
+        except (OSError, asyncio.IncompleteReadError):
+            return
+
+    def on_text(self, payload, now):
+        try:
+            message = json.loads(payload)
+        except ValueError:
+            return
+        for item in message if isinstance(message, list) else [message]:
+            if not isinstance(item, dict) or "light_value" not in item or "room_id" not in item:
+                continue
+            # A dimmable light reports its brightness, only on/off is matched
+            probe = self.pending.get((item["room_id"], bool(item["light_value"])))
+            if probe is not None and self.index not in probe["received"]:
+                probe["received"][self.index] = now - probe["sent"]
+                if len(probe["received"]) == probe["expected"]:
+                    probe["done"].set()
+
+    async def close(self):
+        if self.writer is None:
+            return
+        try:
+            self.writer.write(ws_encode_frame(WS_OP_CLOSE, struct.pack("!H", 1000)))
+            await self.writer.drain()
+        except OSError:
+            pass
+        if self.task is not None:
+            self.task.cancel()
+        self.writer.close()
+
+
+async def run_ws_scenario(args, rooms, subscribers):
+    room = rooms[0] if rooms else {"room_id": 0}
+    room_id = room["room_id"]
+    light_on = bool(room.get("light_gpio_value"))
+    pending = {}
+    clients = [WsSubscriber(i, pending) for i in range(subscribers)]
+    connected = []
+
+    for client in clients:
+        try:
+            await client.connect(args.host, args.port)
+            connected.append(client)
+        except (OSError, asyncio.TimeoutError, HttpError) as err:
+            print("ws subscriber %d: %s" % (client.index, err), file=sys.stderr)
+    await asyncio.sleep(0.5)
+
+    latencies = []
+    missed = 0
+    post_errors = 0
+    for _ in range(args.ws_toggles if connected else 0):
+        light_on = not light_on
+        key = (room_id, light_on)
+        probe = {"sent": time.perf_counter(), "received": {}, "expected": len(connected),
+                 "done": asyncio.Event()}
+        pending[key] = probe
+        try:
+            status, _ = await http_once(args.host, args.port, "POST", "/api/v1/light",
+                                        {"room_id": room_id, "light_value": int(light_on)})
+        except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, HttpError):
+            status = 0
+        if not 200 <= status < 400:
+            post_errors += 1
+        else:
+            try:
+                await asyncio.wait_for(probe["done"].wait(), REQUEST_TIMEOUT_S)
+            except asyncio.TimeoutError:
+                pass
+        del pending[key]
+        latencies.extend(probe["received"].values())
+        missed += len(connected) - len(probe["received"])
+        await asyncio.sleep(args.ws_interval)
+
+    frames = sum(c.frames for c in connected)
+    for client in connected:
+        await client.close()
+
+    return {
+        "scenario": "ws_fanout",
+        "subscribers": subscribers,
+        "connected": len(connected),
+        "toggles": args.ws_toggles,
+        "updates": len(latencies),
+        "missed": missed,
+        "errors": post_errors + subscribers - len(connected),
+        "frames": frames,
+        "latency_ms": latency_summary(latencies),
+    }
+
+
+# --- Target metrics ---
+
+async def fetch_target_metrics(host, port):
+    """Gauges and counters of /api/v1/metrics, histogram buckets left out."""
+    try:
+        status, data = await http_once(host, port, "GET", "/api/v1/metrics")
+    except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, HttpError):
+        return None
+    if status != 200:
+        return None
+
+    samples = {}
+    for line in data.decode(errors="replace").splitlines():
+        if not line or line.startswith("#") or "_bucket{" in line:
+            continue
+        name, _, value = line.rpartition(" ")
+        try:
+            samples[name] = float(value)
+        except ValueError:
+            pass
+    return samples
+
+
+# --- Reporting ---
+
+def result_key(result):
+    return "%s/%s" % (result["scenario"], result.get("concurrency", result.get("subscribers")))
+
+
+def print_table(results):
+    print("%-16s %8s %9s %7s %10s %9s %9s %9s" %
+          ("scenario", "clients", "requests", "errors", "req/s", "p50 ms", "p99 ms", "max ms"))
+    for r in results:
+        lat = r["latency_ms"]
+        fmt = lambda v: "-" if v is None else "%.2f" % v
+        print("%-16s %8d %9d %7d %10s %9s %9s %9s" % (
+            r["scenario"], r.get("concurrency", r.get("subscribers")),
+            r.get("requests", r.get("updates", 0)), r["errors"],
+            fmt(r.get("throughput_rps")), fmt(lat["p50"]), fmt(lat["p99"]), fmt(lat["max"])))
+
+
+def compare(baseline, results, tolerance):
+    """Returns a line per regression against the baseline results."""
+    previous = {result_key(r): r for r in baseline.get("results", [])}
+    regressions = []
+
+    for r in results:
+        base = previous.get(result_key(r))
+        if base is None:
+            continue
+        if base.get("throughput_rps") and r.get("throughput_rps") is not None and \
+                r["throughput_rps"] < base["throughput_rps"] * (1.0 - tolerance):
+            regressions.append("%s: throughput %.2f -> %.2f req/s" %
+                               (result_key(r), base["throughput_rps"], r["throughput_rps"]))
+        base_p99 = base["latency_ms"].get("p99")
+        p99 = r["latency_ms"].get("p99")
+        if base_p99 and p99 is not None and p99 > base_p99 * (1.0 + tolerance):
+            regressions.append("%s: p99 latency %.2f -> %.2f ms" % (result_key(r), base_p99, p99))
+        if r.get("missed", 0) > base.get("missed", 0):
+            regressions.append("%s: missed updates %d -> %d" %
+                               (result_key(r), base.get("missed", 0), r["missed"]))
+    return regressions
+
+
+def parse_int_list(text):
+    return [int(v) for v in text.split(",") if v.strip()]
+
+
+def parse_mix(text):
+    mix = {}
+    for part in text.split(","):
+        name, _, weight = part.partition("=")
+        if name not in ("rooms", "light", "temp"):
+            raise argparse.ArgumentTypeError("unknown mix entry %r" % name)
+        mix[name] = float(weight or 1)
+    return mix
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--host", default=DEFAULT_HOST)
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--scenarios", default="rooms,light,temp,mixed,ws",
+                        help="comma separated, of rooms, light, temp, mixed and ws")
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds per HTTP scenario")
+    parser.add_argument("--concurrency", type=parse_int_list, default=[1, 4],
+                        help="concurrent HTTP clients, a comma separated sweep")
+    parser.add_argument("--keep-alive", action="store_true",
+                        help="reuse connections instead of one per request")
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("rooms=6,light=3,temp=1"),
+                        help="weights of the mixed scenario")
+    parser.add_argument("--ws-clients", type=parse_int_list, default=[1, 2, 4],
+                        help="subscriber counts of the ws scenario, at most CONFIG_SMARTHOME_WS_MAX_CLIENTS")
+    parser.add_argument("--ws-toggles", type=int, default=50, help="light updates per subscriber count")
+    parser.add_argument("--ws-interval", type=float, default=0.1,
+                        help="seconds between light updates, keep it above the WebSocket batching window")
+    parser.add_argument("--label", default=None, help="free text stored with the results, e.g. a release")
+    parser.add_argument("--output", help="write the results as JSON to this file")
+    parser.add_argument("--baseline", help="earlier JSON results to compare with")
+    parser.add_argument("--tolerance", type=float, default=0.2,
+                        help="allowed relative throughput drop and p99 growth against the baseline")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the mixed workload")
+    return parser.parse_args()
+
+
+async def main():
+    args = parse_args()
+    random.seed(args.seed)
+    scenarios = [s.strip() for s in args.scenarios.split(",") if s.strip()]
+
+    rooms = await fetch_rooms(args.host, args.port)
+    workload = Workload(rooms, args.mix)
+    results = []
+
+    for name in scenarios:
+        if name == "ws":
+            for subscribers in args.ws_clients:
+                results.append(await run_ws_scenario(args, rooms, subscribers))
+            continue
+        if name not in ("rooms", "light", "temp", "mixed"):
+            raise SystemExit("unknown scenario %r" % name)
+        for concurrency in args.concurrency:
+            results.append(await run_http_scenario(args, name, getattr(workload, name), concurrency))
+
+    report = {
+        "version": RESULTS_VERSION,
+        "label": args.label,
+        "timestamp": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "target": "http://%s:%d" % (args.host, args.port),
+        "settings": {
+            "duration_s": args.duration,
+            "keep_alive": args.keep_alive,
+            "mix": args.mix,
+            "ws_toggles": args.ws_toggles,
+            "ws_interval_s": args.ws_interval,
+            "seed": args.seed,
+        },
+        "rooms": len(rooms),
+        "results": results,
+        "target_metrics": await fetch_target_metrics(args.host, args.port),
+    }
+
+    print_table(results)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+            f.write("\n")
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(json.load(f), results, args.tolerance)
+        for line in regressions:
+            print("REGRESSION " + line, file=sys.stderr)
+        return 1 if regressions else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(asyncio.run(main()))
@@ -0,0 +1,66 @@
+/* Emulated PWM controller, keeps what was set on each channel so the dimmable
+ * lights work on native_sim
+ */
+#define DT_DRV_COMPAT smarthome_sim_pwm
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/pwm.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(sim_pwm, CONFIG_PWM_LOG_LEVEL);
+
+struct sim_pwm_channel {
+    uint32_t period;                           // Cycles
+    uint32_t pulse;                            // Cycles
+    uint32_t updates;                          // Number of set_cycles calls
+};
+
+struct sim_pwm_config {
+    struct sim_pwm_channel *channels;
+    uint32_t channel_count;
+    uint32_t clock_frequency;                  // Hz
+};
+
+/* Called from the fade timer ISR, so it only stores */
+static int sim_pwm_set_cycles(const struct device *dev, uint32_t channel, uint32_t period_cycles,
+                              uint32_t pulse_cycles, pwm_flags_t flags) {
+    const struct sim_pwm_config *cfg = dev->config;
+
+    if (channel >= cfg->channel_count || pulse_cycles > period_cycles) {
+        return -EINVAL;
+    }
+
+    struct sim_pwm_channel *ch = &cfg->channels[channel];
+    ch->period = period_cycles;
+    ch->pulse = pulse_cycles;
+    ch->updates++;
+    return 0;
+}
+
+static int sim_pwm_get_cycles_per_sec(const struct device *dev, uint32_t channel, uint64_t *cycles) {
+    const struct sim_pwm_config *cfg = dev->config;
+
+    if (channel >= cfg->channel_count) {
+        return -EINVAL;
+    }
+    *cycles = cfg->clock_frequency;
+    return 0;
+}
+
+static DEVICE_API(pwm, sim_pwm_api) = {
+    .set_cycles = sim_pwm_set_cycles,
+    .get_cycles_per_sec = sim_pwm_get_cycles_per_sec,
+};
+
+#define SIM_PWM_DEFINE(n)                                                      \
+    static struct sim_pwm_channel sim_pwm_channels_##n[DT_INST_PROP(n, channels)]; \
+    static const struct sim_pwm_config sim_pwm_config_##n = {                 \
+        .channels = sim_pwm_channels_##n,                                      \
+        .channel_count = DT_INST_PROP(n, channels),                            \
+        .clock_frequency = DT_INST_PROP(n, clock_frequency),                   \
+    };                                                                         \
+    DEVICE_DT_INST_DEFINE(n, NULL, NULL, NULL, &sim_pwm_config_##n,           \
+                          POST_KERNEL, CONFIG_PWM_INIT_PRIORITY, &sim_pwm_api);
+
+DT_INST_FOREACH_STATUS_OKAY(SIM_PWM_DEFINE)
@@ -0,0 +1,462 @@
+/* Emulated temperature/humidity sensor, stands in for the hs300x and DHT11
+ * parts on native_sim.
+ *
+ * Every instance plays back a scripted temperature waveform with noise,
+ * periodic dropouts, random failures and a read latency, configured from the
+ * devicetree and changeable at run time with the "sim_sensor" shell command.
+ * Readings go through sensor_sample_fetch()/sensor_channel_get() as well as
+ * through RTIO with the decoder below, so both read paths of the app see the
+ * same script.
+ */
+#define DT_DRV_COMPAT smarthome_sim_sensor
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/drivers/sensor_data_types.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <stdlib.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(sim_sensor, CONFIG_SENSOR_LOG_LEVEL);
+
+/* Same order as the waveform enum of the binding */
+enum sim_sensor_waveform {
+    SIM_SENSOR_CONSTANT,
+    SIM_SENSOR_RAMP,                           // Sawtooth from base up to base + amplitude
+    SIM_SENSOR_TRIANGLE,                       // Up to base + amplitude and back down
+    SIM_SENSOR_STEP,                           // base for the first half period, base + amplitude after
+    SIM_SENSOR_WAVEFORM_COUNT
+};
+
+static const char *const sim_sensor_waveform_names[SIM_SENSOR_WAVEFORM_COUNT] = {
+    "constant", "ramp", "triangle", "step",
+};
+
+struct sim_sensor_script {
+    int32_t waveform;                          // enum sim_sensor_waveform
+    int32_t temperature;                       // Base temperature, 0.01 C
+    int32_t humidity;                          // Base humidity, 0.01 %RH
+    int32_t amplitude;                         // Waveform amplitude, 0.01 C
+    int32_t period_ms;                         // Waveform period, 0 keeps it constant
+    int32_t noise;                             // Uniform noise of +-noise on both readings
+    int32_t dropout_period_ms;                 // Every period ends with a dropout...
+    int32_t dropout_ms;                        // ...this long, during which reads fail
+    int32_t failure_permille;                  // Reads failing at random
+    int32_t latency_us;                        // Time a read takes
+};
+
+struct sim_sensor_stats {
+    uint32_t reads;                            // Readings delivered
+    uint32_t dropouts;                         // Reads failed in a dropout
+    uint32_t failures;                         // Reads failed at random
+};
+
+struct sim_sensor_config {
+    struct sim_sensor_script script;           // Initial script from the devicetree
+    uint32_t seed;
+};
+
+struct sim_sensor_data {
+    const struct device *dev;
+    struct k_spinlock lock;                    // Guards everything below
+    struct sim_sensor_script script;
+    int64_t start_ms;                          // Uptime the waveform started at
+    uint32_t rng;                              // xorshift32 state, fixed seed so runs repeat
+    struct sim_sensor_stats stats;
+    int32_t temperature;                       // Last fetched sample, 0.01 C
+    int32_t humidity;                          // 0.01 %RH
+#ifdef CONFIG_SENSOR_ASYNC_API
+    struct k_work_delayable read_work;         // Completes the RTIO read after the latency
+    struct rtio_iodev_sqe *pending;            // RTIO read in flight
+#endif
+};
+
+static uint32_t sim_sensor_rand(struct sim_sensor_data *data) {
+    uint32_t x = data->rng;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    data->rng = x;
+    return x;
+}
+
+static int32_t sim_sensor_noise(struct sim_sensor_data *data, int32_t noise) {
+    if (noise <= 0) {
+        return 0;
+    }
+    return (int32_t)(sim_sensor_rand(data) % (2 * (uint32_t)noise + 1)) - noise;
+}
+
+static int32_t sim_sensor_wave(const struct sim_sensor_script *script, uint32_t t_ms) {
+    if (script->period_ms <= 0) {
+        return 0;
+    }
+
+    uint32_t period = script->period_ms;
+    uint32_t phase = t_ms % period;
+
+    switch (script->waveform) {
+    case SIM_SENSOR_RAMP:
+        return (int64_t)script->amplitude * phase / period;
+    case SIM_SENSOR_TRIANGLE:
+        if (phase < period / 2) {
+            return (int64_t)script->amplitude * phase / (period / 2);
+        }
+        return (int64_t)script->amplitude * (period - phase) / (period - period / 2);
+    case SIM_SENSOR_STEP:
+        return phase < period / 2 ? 0 : script->amplitude;
+    default:
+        return 0;
+    }
+}
+
+/* Produces the reading due now, or the error the script asks for */
+static int sim_sensor_generate(struct sim_sensor_data *data, int32_t *temperature, int32_t *humidity) {
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    const struct sim_sensor_script *script = &data->script;
+    uint32_t t_ms = (uint32_t)(k_uptime_get() - data->start_ms);
+    int rc = 0;
+
+    if (script->dropout_period_ms > 0 && script->dropout_ms > 0 &&
+        t_ms % script->dropout_period_ms >= script->dropout_period_ms - script->dropout_ms) {
+        data->stats.dropouts++;
+        rc = -EIO;
+    } else if (script->failure_permille > 0 &&
+               sim_sensor_rand(data) % 1000 < (uint32_t)script->failure_permille) {
+        data->stats.failures++;
+        rc = -EIO;
+    } else {
+        *temperature = script->temperature + sim_sensor_wave(script, t_ms) +
+                       sim_sensor_noise(data, script->noise);
+        *humidity = CLAMP(script->humidity + sim_sensor_noise(data, script->noise), 0, 10000);
+        data->stats.reads++;
+    }
+
+    k_spin_unlock(&data->lock, key);
+    return rc;
+}
+
+static int32_t sim_sensor_latency_us(struct sim_sensor_data *data) {
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    int32_t latency_us = data->script.latency_us;
+    k_spin_unlock(&data->lock, key);
+    return latency_us;
+}
+
+static int sim_sensor_sample_fetch(const struct device *dev, enum sensor_channel chan) {
+    struct sim_sensor_data *data = dev->data;
+
+    if (chan != SENSOR_CHAN_ALL && chan != SENSOR_CHAN_AMBIENT_TEMP && chan != SENSOR_CHAN_HUMIDITY) {
+        return -ENOTSUP;
+    }
+
+    // A fetch blocks the caller for the read time, like the single-wire DHT11 does
+    int32_t latency_us = sim_sensor_latency_us(data);
+    if (latency_us > 0) {
+        k_usleep(latency_us);
+    }
+
+    return sim_sensor_generate(data, &data->temperature, &data->humidity);
+}
+
+static int sim_sensor_channel_get(const struct device *dev, enum sensor_channel chan,
+                                  struct sensor_value *val) {
+    const struct sim_sensor_data *data = dev->data;
+
+    switch (chan) {
+    case SENSOR_CHAN_AMBIENT_TEMP:
+        return sensor_value_from_milli(val, data->temperature * 10);
+    case SENSOR_CHAN_HUMIDITY:
+        return sensor_value_from_milli(val, data->humidity * 10);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+#ifdef CONFIG_SENSOR_ASYNC_API
+/* Encoded RTIO reading, decoded by the decoder below */
+struct sim_sensor_edata {
+    uint64_t timestamp_ns;
+    int32_t temperature;                       // 0.01 C
+    int32_t humidity;                          // 0.01 %RH
+};
+
+/* Both channels fit +-256 in Q31 with this shift */
+#define SIM_SENSOR_Q31_SHIFT 8
+
+static q31_t sim_sensor_centi_to_q31(int32_t centi) {
+    int64_t v = (int64_t)centi << (31 - SIM_SENSOR_Q31_SHIFT);
+
+    // Rounded up so (q * 100) >> (31 - shift) gives back the exact value
+    return (q31_t)((v >= 0 ? v + 99 : v) / 100);
+}
+
+static int sim_sensor_decoder_get_frame_count(const uint8_t *buffer, struct sensor_chan_spec chan_spec,
+                                              uint16_t *frame_count) {
+    if (chan_spec.chan_idx != 0 ||
+        (chan_spec.chan_type != SENSOR_CHAN_AMBIENT_TEMP && chan_spec.chan_type != SENSOR_CHAN_HUMIDITY)) {
+        return -ENOTSUP;
+    }
+    *frame_count = 1;
+    return 0;
+}
+
+static int sim_sensor_decoder_get_size_info(struct sensor_chan_spec chan_spec, size_t *base_size,
+                                            size_t *frame_size) {
+    if (chan_spec.chan_type != SENSOR_CHAN_AMBIENT_TEMP && chan_spec.chan_type != SENSOR_CHAN_HUMIDITY) {
+        return -ENOTSUP;
+    }
+    *base_size = sizeof(struct sensor_q31_data);
+    *frame_size = sizeof(struct sensor_q31_sample_data);
+    return 0;
+}
+
+static int sim_sensor_decoder_decode(const uint8_t *buffer, struct sensor_chan_spec chan_spec,
+                                     uint32_t *fit, uint16_t max_count, void *data_out) {
+    const struct sim_sensor_edata *edata = (const struct sim_sensor_edata *)buffer;
+    struct sensor_q31_data *out = data_out;
+    int32_t centi;
+
+    if (*fit != 0 || max_count == 0) {
+        return 0;
+    }
+
+    switch (chan_spec.chan_type) {
+    case SENSOR_CHAN_AMBIENT_TEMP:
+        centi = edata->temperature;
+        break;
+    case SENSOR_CHAN_HUMIDITY:
+        centi = edata->humidity;
+        break;
+    default:
+        return -ENOTSUP;
+    }
+
+    out->header.base_timestamp_ns = edata->timestamp_ns;
+    out->header.reading_count = 1;
+    out->shift = SIM_SENSOR_Q31_SHIFT;
+    out->readings[0].timestamp_delta = 0;
+    out->readings[0].value = sim_sensor_centi_to_q31(centi);
+    *fit = 1;
+    return 1;
+}
+
+SENSOR_DECODER_API_DT_DEFINE() = {
+    .get_frame_count = sim_sensor_decoder_get_frame_count,
+    .get_size_info = sim_sensor_decoder_get_size_info,
+    .decode = sim_sensor_decoder_decode,
+};
+
+static int sim_sensor_get_decoder(const struct device *dev, const struct sensor_decoder_api **decoder) {
+    *decoder = &SENSOR_DECODER_NAME();
+    return 0;
+}
+
+static void sim_sensor_read_done(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct sim_sensor_data *data = CONTAINER_OF(dwork, struct sim_sensor_data, read_work);
+    struct rtio_iodev_sqe *iodev_sqe = data->pending;
+    struct sim_sensor_edata *edata;
+    uint8_t *buf;
+    uint32_t buf_len;
+
+    data->pending = NULL;
+
+    int rc = rtio_sqe_rx_buf(iodev_sqe, sizeof(*edata), sizeof(*edata), &buf, &buf_len);
+    if (rc != 0) {
+        rtio_iodev_sqe_err(iodev_sqe, rc);
+        return;
+    }
+
+    edata = (struct sim_sensor_edata *)buf;
+    edata->timestamp_ns = k_ticks_to_ns_floor64(k_uptime_ticks());
+    rc = sim_sensor_generate(data, &edata->temperature, &edata->humidity);
+    if (rc != 0) {
+        rtio_iodev_sqe_err(iodev_sqe, rc);
+        return;
+    }
+    rtio_iodev_sqe_ok(iodev_sqe, 0);
+}
+
+/* Reads complete on the system work queue after the scripted latency, so several
+ * sensors submitted together overlap like real parts on a bus
+ */
+static void sim_sensor_submit(const struct device *dev, struct rtio_iodev_sqe *iodev_sqe) {
+    struct sim_sensor_data *data = dev->data;
+
+    if (data->pending != NULL) {
+        rtio_iodev_sqe_err(iodev_sqe, -EBUSY);
+        return;
+    }
+
+    data->pending = iodev_sqe;
+    k_work_schedule(&data->read_work, K_USEC(MAX(sim_sensor_latency_us(data), 0)));
+}
+#endif /* CONFIG_SENSOR_ASYNC_API */
+
+static DEVICE_API(sensor, sim_sensor_api) = {
+    .sample_fetch = sim_sensor_sample_fetch,
+    .channel_get = sim_sensor_channel_get,
+#ifdef CONFIG_SENSOR_ASYNC_API
+    .submit = sim_sensor_submit,
+    .get_decoder = sim_sensor_get_decoder,
+#endif
+};
+
+static int sim_sensor_init(const struct device *dev) {
+    const struct sim_sensor_config *cfg = dev->config;
+    struct sim_sensor_data *data = dev->data;
+
+    data->dev = dev;
+    data->script = cfg->script;
+    data->rng = cfg->seed != 0 ? cfg->seed : 1;
+    data->temperature = cfg->script.temperature;
+    data->humidity = cfg->script.humidity;
+#ifdef CONFIG_SENSOR_ASYNC_API
+    k_work_init_delayable(&data->read_work, sim_sensor_read_done);
+#endif
+    return 0;
+}
+
+#define SIM_SENSOR_DEFINE(n)                                                   \
+    static const struct sim_sensor_config sim_sensor_config_##n = {           \
+        .script = {                                                            \
+            .waveform = DT_INST_ENUM_IDX(n, waveform),                         \
+            .temperature = DT_INST_PROP(n, temperature),                       \
+            .humidity = DT_INST_PROP(n, humidity),                             \
+            .amplitude = DT_INST_PROP(n, amplitude),                           \
+            .period_ms = DT_INST_PROP(n, period_ms),                           \
+            .noise = DT_INST_PROP(n, noise),                                   \
+            .dropout_period_ms = DT_INST_PROP(n, dropout_period_ms),           \
+            .dropout_ms = DT_INST_PROP(n, dropout_ms),                         \
+            .failure_permille = DT_INST_PROP(n, failure_permille),             \
+            .latency_us = DT_INST_PROP(n, latency_us),                         \
+        },                                                                     \
+        .seed = DT_INST_PROP(n, seed),                                         \
+    };                                                                         \
+    static struct sim_sensor_data sim_sensor_data_##n;                         \
+    SENSOR_DEVICE_DT_INST_DEFINE(n, sim_sensor_init, NULL, &sim_sensor_data_##n, \
+                                 &sim_sensor_config_##n, POST_KERNEL,          \
+                                 CONFIG_SENSOR_INIT_PRIORITY, &sim_sensor_api);
+
+DT_INST_FOREACH_STATUS_OKAY(SIM_SENSOR_DEFINE)
+
+#if defined(CONFIG_SHELL)
+static const struct {
+    const char *name;
+    size_t offset;
+} sim_sensor_params[] = {
+    { "temperature", offsetof(struct sim_sensor_script, temperature) },
+    { "humidity", offsetof(struct sim_sensor_script, humidity) },
+    { "amplitude", offsetof(struct sim_sensor_script, amplitude) },
+    { "period_ms", offsetof(struct sim_sensor_script, period_ms) },
+    { "noise", offsetof(struct sim_sensor_script, noise) },
+    { "dropout_period_ms", offsetof(struct sim_sensor_script, dropout_period_ms) },
+    { "dropout_ms", offsetof(struct sim_sensor_script, dropout_ms) },
+    { "failure_permille", offsetof(struct sim_sensor_script, failure_permille) },
+    { "latency_us", offsetof(struct sim_sensor_script, latency_us) },
+};
+
+static const struct device *sim_sensor_lookup(const struct shell *sh, const char *name) {
+    const struct device *dev = device_get_binding(name);
+
+    if (dev == NULL || dev->api != &sim_sensor_api) {
+        shell_error(sh, "%s is not an emulated sensor", name);
+        return NULL;
+    }
+    return dev;
+}
+
+static void sim_sensor_show_one(const struct shell *sh, const struct device *dev) {
+    struct sim_sensor_data *data = dev->data;
+
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    struct sim_sensor_script script = data->script;
+    struct sim_sensor_stats stats = data->stats;
+    k_spin_unlock(&data->lock, key);
+
+    shell_print(sh, "%s: %s temperature %d amplitude %d period_ms %d humidity %d noise %d",
+                dev->name, sim_sensor_waveform_names[script.waveform], script.temperature,
+                script.amplitude, script.period_ms, script.humidity, script.noise);
+    shell_print(sh, "  dropout %d/%d ms | failure_permille %d | latency_us %d",
+                script.dropout_ms, script.dropout_period_ms, script.failure_permille,
+                script.latency_us);
+    shell_print(sh, "  Reads: %u | Dropouts: %u | Failures: %u",
+                stats.reads, stats.dropouts, stats.failures);
+}
+
+#define SIM_SENSOR_SHOW(n) sim_sensor_show_one(sh, DEVICE_DT_INST_GET(n));
+
+static int cmd_sim_sensor_show(const struct shell *sh, size_t argc, char **argv) {
+    if (argc > 1) {
+        const struct device *dev = sim_sensor_lookup(sh, argv[1]);
+        if (dev == NULL) {
+            return -ENODEV;
+        }
+        sim_sensor_show_one(sh, dev);
+        return 0;
+    }
+
+    DT_INST_FOREACH_STATUS_OKAY(SIM_SENSOR_SHOW)
+    return 0;
+}
+
+/* The waveform restarts from phase 0 on every change, so a script is repeatable */
+static int cmd_sim_sensor_set(const struct shell *sh, size_t argc, char **argv) {
+    const struct device *dev = sim_sensor_lookup(sh, argv[1]);
+    if (dev == NULL) {
+        return -ENODEV;
+    }
+
+    struct sim_sensor_data *data = dev->data;
+    int32_t *field = NULL;
+    int32_t value = 0;
+
+    if (strcmp(argv[2], "waveform") == 0) {
+        for (value = 0; value < SIM_SENSOR_WAVEFORM_COUNT; value++) {
+            if (strcmp(argv[3], sim_sensor_waveform_names[value]) == 0) {
+                break;
+            }
+        }
+        if (value == SIM_SENSOR_WAVEFORM_COUNT) {
+            shell_error(sh, "Waveform is one of constant, ramp, triangle, step");
+            return -EINVAL;
+        }
+        field = &data->script.waveform;
+    } else {
+        for (size_t i = 0; i < ARRAY_SIZE(sim_sensor_params); i++) {
+            if (strcmp(argv[2], sim_sensor_params[i].name) == 0) {
+                field = (int32_t *)((uint8_t *)&data->script + sim_sensor_params[i].offset);
+                break;
+            }
+        }
+        if (field == NULL) {
+            shell_error(sh, "Unknown parameter %s", argv[2]);
+            return -EINVAL;
+        }
+        value = strtol(argv[3], NULL, 10);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    *field = value;
+    data->start_ms = k_uptime_get();
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sim_sensor_cmds,
+    SHELL_CMD_ARG(show, NULL, "Show scripts and counters: show [device]", cmd_sim_sensor_show, 1, 1),
+    SHELL_CMD_ARG(set, NULL,
+                  "Change a script parameter: set <device> <param> <value>\n"
+                  "params: waveform temperature humidity amplitude period_ms noise\n"
+                  "        dropout_period_ms dropout_ms failure_permille latency_us",
+                  cmd_sim_sensor_set, 4, 0),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(sim_sensor, &sim_sensor_cmds, "Emulated temperature/humidity sensors", NULL);
+#endif
@@ -0,0 +1,14 @@
+#ifndef FADE_H
+#define FADE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/pwm.h>
+#include <stdint.h>
+
+/* Starts fading a PWM light towards brightness percent (0-100). A fade
+ * already running on the channel is retargeted from its current level.
+ * Returns -ENOMEM when more channels fade than there are rooms.
+ */
+int light_fade_to(const struct pwm_dt_spec *pwm, uint8_t percent);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <zephyr/kernel.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum history_res {
+    HISTORY_RES_RAW,
+    HISTORY_RES_1M,
+    HISTORY_RES_15M,
+    HISTORY_RES_COUNT
+};
+
+/* One stored point, raw samples have min == avg == max */
+struct history_point {
+    uint32_t time_s;                           // Uptime (s) of the sample or bucket start
+    int16_t temp_min;                          // Temperature scaled by 100
+    int16_t temp_avg;
+    int16_t temp_max;
+    uint16_t hum_min;                          // Humidity scaled by 100
+    uint16_t hum_avg;
+    uint16_t hum_max;
+};
+
+/* Records one sensor reading, feeding the raw ring and the 1 and 15 minute buckets */
+void history_add_sample(int room_id, uint32_t temp_scaled, uint32_t hum_scaled);
+
+/* Points are numbered by a per-ring sequence counting every point ever stored.
+ * Returns the sequence of the oldest stored point and one past the newest.
+ */
+int history_range(int room_id, enum history_res res, uint32_t *first, uint32_t *end);
+
+/* Copies point seq of a room ring, returns -ENOENT once it was overwritten or before it is stored */
+int history_read(int room_id, enum history_res res, uint32_t seq, struct history_point *point);
+
+/* Parses "raw", "1m" or "15m", returns HISTORY_RES_COUNT when unknown */
+enum history_res history_res_from_str(const char *str, size_t len);
+
+#endif
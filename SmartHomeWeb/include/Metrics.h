@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/mem_stats.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Room.h"
+#include "Settings.h"
+
+/* Stages of the event pipeline, each one feeds its own latency histogram.
+ * The origin of an event is the switch edge for a wall switch, otherwise the
+ * moment its command or sensor sample was handed to the room controller.
+ */
+enum latency_stage {
+    LATENCY_EVENT_QUEUE,                       // Event created -> taken from events_fifo
+    LATENCY_EVENT_ACTION,                      // Taken from events_fifo -> actuator action returned
+    LATENCY_EVENT_TOTAL,                       // Origin -> actuator action returned
+    LATENCY_WEB_EVENT_QUEUE,                   // WebEvent created -> taken from web_events_fifo
+    LATENCY_WEB_EVENT_SEND,                    // Taken from web_events_fifo -> frame sent to a client
+    LATENCY_WEB_EVENT_TOTAL,                   // Origin -> frame sent to a client
+    LATENCY_STAGE_COUNT
+};
+
+/* Fixed upper bounds from 50 us to 1 s, plus the +Inf bucket */
+#define LATENCY_BUCKET_COUNT 14
+
+struct latency_histogram {
+    uint32_t buckets[LATENCY_BUCKET_COUNT + 1]; // Samples per bucket, not cumulative
+    uint32_t count;
+    uint64_t sum_us;
+};
+
+#define METRICS_THREAD_NAME_LEN 24
+
+struct thread_metrics {
+    char name[METRICS_THREAD_NAME_LEN];
+    uint32_t stack_size;                       // Bytes
+    uint32_t stack_unused;                     // Bytes never touched since boot
+    uint64_t cycles;                           // Execution cycles since boot
+};
+
+/* Everything /api/v1/metrics reports, copied at the start of a request */
+struct metrics_snapshot {
+    struct latency_histogram latency[LATENCY_STAGE_COUNT];
+    struct sys_memory_stats heap;
+    struct fifo_stats events_fifo;
+    struct fifo_stats web_events_fifo;
+    uint32_t ws_clients;                       // Connected WebSocket clients
+    struct room_counters rooms[ROOM_COUNT];
+    struct room_settings_stats settings;
+    uint64_t total_cycles;                     // Execution cycles of all threads, idle included
+    size_t thread_count;
+    struct thread_metrics threads[CONFIG_SMARTHOME_METRICS_MAX_THREADS];
+};
+
+/* Longest line metrics_format_line() produces */
+#define METRICS_LINE_MAX 128
+
+/* Cycle count for a pipeline timestamp, never 0 so 0 can mean "not stamped" */
+static inline uint32_t latency_stamp(void) {
+    return k_cycle_get_32() | 1;
+}
+
+/* Records the time from start_cycles (a latency_stamp()) until now, a 0 start is ignored */
+void latency_record(enum latency_stage stage, uint32_t start_cycles);
+
+void metrics_snapshot_take(struct metrics_snapshot *snap);
+
+/* Formats line idx of the Prometheus text exposition of snap, without the newline.
+ * Returns its length, 0 past the last line, or -ENOMEM when it doesn't fit buf.
+ */
+int metrics_format_line(const struct metrics_snapshot *snap, size_t idx, char *buf, size_t len);
+
+#endif
@@ -24,11 +24,9 @@ enum {
     ROOM_LED_COUNT
 };
 
-enum {
-    LIVINROOM_ROOM,
-    KITCHEN_ROOM,
-    STRUCT_ROOM_COUNT
-};
+/* Rooms are the children of the "smarthome,rooms" node, the id is the child index */
+#define ROOMS_NODE DT_PATH(rooms)
+#define ROOM_COUNT DT_CHILD_NUM(ROOMS_NODE)
 
 enum VALUE_TYPE {
     SWITCH_EV,
@@ -48,6 +46,9 @@ struct Event {
     event_action_t action;
     void *ctx;
     uint32_t value;
+    uint32_t input_cycles;                     // Cycle count of the switch edge behind it, 0 if none
+    uint32_t origin_cycles;                    // latency_stamp() of the input or command behind it
+    uint32_t created_cycles;                   // latency_stamp() when it was registered
 };
 
 struct WebEvent {
@@ -55,62 +56,183 @@ struct WebEvent {
     int room_id;
     enum VALUE_TYPE value_type;
     uint32_t value;
+    uint32_t origin_cycles;                    // Same as in struct Event
+    uint32_t created_cycles;
 };
 
-struct Room {
-    void* fifo_reserved;
+struct event_pool_stats {
+    uint32_t used;                             // Blocks currently allocated
+    uint32_t max_used;                         // High-water mark
+    uint32_t capacity;                         // Total blocks in the pool
+    uint32_t alloc_failures;                   // Allocations refused (pool empty)
+};
+
+struct fifo_stats {
+    uint32_t depth;                            // Items queued right now
+    uint32_t peak;                             // High-water mark
+};
 
-    const uint8_t room_id;
+/* Control loop activity of one room since boot */
+struct room_counters {
+    uint32_t climate_samples;                  // Sensor samples handled by the controller
+    uint32_t heat_relay_switches;              // Heat relay on/off transitions
+};
+
+struct executor_stats {
+    uint32_t applied;                          // Events executed on an actuator
+    uint32_t coalesced;                        // Stale events superseded before execution
+    uint32_t switch_actuations;                // Events applied for a wall switch press
+    uint32_t switch_last_us;                   // Press-to-actuation latency of the last one
+    uint32_t switch_max_us;                    // Worst press-to-actuation latency
+    uint64_t switch_total_us;                  // Sum of the latencies, for the average
+};
+
+/* Mutable part of a room, 8 bytes of RAM per room. Owned by the room controller
+ * thread, everyone else reads a copy through room_snapshot_read()/room_state_get().
+ */
+struct room_state {
+    int16_t temp_sensor_value;                 // Last read temperature, 0.01 C
+    uint16_t hum_sensor_value;                 // Last read humidity, 0.01 %RH
+    int16_t desired_temperature;               // Desired temperature, 0.01 C
+    uint16_t temperature_offset;               // Heating hysteresis around it, 0.01 C
+    uint8_t light_gpio_value;                  // GPIO level, or PWM brightness in percent
+    bool heat_relay_state;                     // OUTPUT HEAT relay state
+};
+
+/* The part of a room's state kept across reboots, see Settings.c. Its layout is
+ * the stored record, so fields are only ever appended.
+ */
+struct room_settings {
+    int16_t desired_temperature;
+    uint16_t temperature_offset;
+    uint8_t light_gpio_value;
+    uint8_t reserved;                          // Keeps the record free of padding
+};
+
+/* Wiring of a room, generated from the devicetree and kept in flash.
+ * Absent actuators have a NULL port/dev, absent sensors a NULL device.
+ */
+struct Room {
+    uint8_t room_id;
     const char* room_name;
 
 /* Light */
     /* Switch can toggle pwm device or gpio*/
-    const struct gpio_dt_spec* light_switch;   // INPUT
-    const struct pwm_dt_spec* light_pwm;       // OUTPUT PWM
-    const struct gpio_dt_spec* light_gpio;     // OUTPUT GPIO
-    uint32_t light_gpio_value;                 // Current GPIO value
+    struct gpio_dt_spec light_switch;          // INPUT
+    struct pwm_dt_spec light_pwm;              // OUTPUT PWM
+    struct gpio_dt_spec light_gpio;            // OUTPUT GPIO
 
 /* Heat */
-    /* Sensor and RTIO IODEV for DHT22 */
-    const struct device *const dht_devices;    // INPUT DHT device
-    struct rtio_iodev *const dht_iodevs;       // RTIO IODEV for DHT
-    const struct device *const temp_dht11;     // INPUT Temperature sensor device
-    uint32_t temp_sensor_value;                // Last read temperature
-    uint32_t hum_sensor_value;                 // Last read humidity
+    /* hs300x sensor, read through the RTIO pipeline in Sensor.c */
+    const struct device *hs300x;               // INPUT hs300x device
+    const struct device *temp_dht11;           // INPUT Temperature sensor device
     /* Actuators */
-    const struct gpio_dt_spec* heat_relay;     // OUTPUT HEAT relay GPIO
-    bool heat_relay_state;                     // OUTPUT HEAT relay state
-    uint32_t desired_temperature;              // Desired temperature
-
-    uint32_t offset_desired_temperature;       // Offset for desired temperature
-                                               // VALUES: 25  - 0.25 C
-                                               //         50  - 0.50 C
-                                               //         75  - 0.75 C
-                                               //         100 - 1.00 C
+    struct gpio_dt_spec heat_relay;            // OUTPUT HEAT relay GPIO
 };
 
+struct Event* event_alloc(void);
+
+void event_free(struct Event *event);
+
+struct WebEvent* web_event_alloc(void);
+
+void web_event_free(struct WebEvent *web_event);
+
+/* Takes the next event from events_fifo, use instead of k_fifo_get() so its depth stays tracked */
+struct Event* event_get(k_timeout_t timeout);
+
+/* Same for web_events_fifo */
+struct WebEvent* web_event_get(k_timeout_t timeout);
+
+void get_event_pool_stats(struct event_pool_stats *stats);
+
+void get_web_event_pool_stats(struct event_pool_stats *stats);
+
+void get_events_fifo_stats(struct fifo_stats *stats);
+
+void get_web_events_fifo_stats(struct fifo_stats *stats);
+
+void get_executor_stats(struct executor_stats *stats);
+
+/* False for an id outside [0, ROOM_COUNT) */
+bool get_room_counters(int id, struct room_counters *counters);
+
 void gpio_event_action(void *ctx, uint32_t value);
 
+/* Fades the PWM light in ctx to brightness value (percent) */
 void pwm_event_action(void *ctx, uint32_t value);
 
-bool room_device_init();
+bool room_device_init(void);
+
+/* Takes over settings restored from flash, only valid before room_controller_start().
+ * A restored light is switched once the controller runs.
+ */
+void room_settings_restore(const struct Room *room, const struct room_settings *settings);
 
-struct Room** get_all_rooms();
+/* Starts the room controller thread, commands posted before are handled from then on */
+void room_controller_start(void);
 
-struct Room* get_room_by_id(int id);
+/* Version of the last published snapshot, bumped whenever a room changes */
+uint32_t room_state_version(void);
 
+/* Copies the last published state of every room, never blocks and never returns
+ * a half updated table. Returns the version of the copied snapshot.
+ */
+uint32_t room_snapshot_read(struct room_state states[ROOM_COUNT]);
+
+/* Copies the last published state of one room, false for an id outside [0, ROOM_COUNT) */
+bool room_state_get(int id, struct room_state *state);
+
+/* Returns NULL for an id outside [0, ROOM_COUNT) */
+const struct Room* get_room_by_id(int id);
+
+/* Returns NULL for an id outside [0, ROOM_LED_COUNT) */
 const struct gpio_dt_spec* get_led_by_id(int id);
 
-int register_new_event(struct Room *room, uint32_t new_value, enum VALUE_TYPE event_type, bool is_for_web_event);
+int read_temp_and_hum(const struct Room *room, uint32_t* temp_fit, uint32_t* hum_fit);
+
+int read_temp_and_hum_dht11(const struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled);
+
+/* The process_* calls and room_apply_batch() post a command to the room controller
+ * thread and return, the change shows up in the next snapshot. Commands are handled
+ * in the order they were posted. The light and heat relay controls and batches wait
+ * for the controller and report -ENOMEM when the event pool was exhausted, the state
+ * is then left as it was.
+ */
+
+enum room_op_type {
+    ROOM_OP_LIGHT,                             // Same as process_light_control()
+    ROOM_OP_SETPOINT,                          // Desired temperature, re-evaluates the heating
+    ROOM_OP_HYSTERESIS,                        // Heating hysteresis (0.01 C), re-evaluates the heating
+    ROOM_OP_HEAT_RELAY,                        // Same as process_heat_relay_control()
+};
+
+/* One change of a batch */
+struct room_op {
+    const struct Room *room;
+    enum room_op_type type;
+    int32_t value;
+    int result;                                // Set by the controller, same as the process_* calls
+};
+
+/* Hands the ops to the controller as a single command and waits until they are applied.
+ * They are executed, published and pushed to the web clients together, commands of
+ * other threads are not held back.
+ */
+void room_apply_batch(struct room_op *ops, size_t count);
 
-int read_temp_and_hum(struct Room *room, uint32_t* temp_fit, uint32_t* hum_fit);
+/* Stores a temperature/humidity sample and re-evaluates the heating */
+void process_climate_sample(const struct Room *room, uint32_t temp_scaled, uint32_t hum_scaled);
 
-int read_temp_and_hum_dht11(struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled);
+/* Switches the heat relay directly, the next temperature sample may switch it back */
+int process_heat_relay_control(const struct Room *room, bool turn_on);
 
-bool register_new_web_event(uint32_t room_id, enum VALUE_TYPE value_type, uint32_t value);
+int process_light_control(const struct Room *room, uint32_t new_light_gpio_value);
 
-void process_temperature_control(struct Room *room);
+/* Same as process_light_control() without waiting, press_cycles is the k_cycle_get_32() of the switch edge */
+void process_light_switch(const struct Room *room, uint32_t new_light_gpio_value, uint32_t press_cycles);
 
-void process_light_control(struct Room *room, uint32_t new_light_gpio_value);
+/* Light value for the ON state: 1 for a GPIO light, CONFIG_SMARTHOME_LIGHT_ON_BRIGHTNESS for a PWM light */
+uint32_t room_light_on_value(const struct Room *room);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <stddef.h>
+
+struct sensor_read_stats {
+    uint32_t reads;                            // Completed reads
+    uint32_t errors;                           // Failed or undecodable reads
+    uint32_t last_us;                          // Submit-to-completion latency of the last read
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;                         // Sum of all latencies, for the average
+};
+
+struct sensor_cache_stats {
+    uint32_t hits;                             // Requests served from the cached sample
+    uint32_t misses;                           // Requests that triggered a hardware fetch
+    uint32_t errors;                           // Hardware fetches that failed
+};
+
+/* Fetches one sample from the hardware, temperature and humidity scaled by 100 */
+typedef int (*sensor_fetch_fn)(const struct device *dev, uint32_t *temp_scaled, uint32_t *hum_scaled);
+
+/* Submits one RTIO read for every hs300x sensor in a single batch and waits for all completions */
+int hs300x_read_all(void);
+
+/* Last decoded sample of a sensor, temperature and humidity scaled by 100 */
+int hs300x_get_sample(const struct device *dev, uint32_t *temp_scaled, uint32_t *hum_scaled);
+
+size_t hs300x_sensor_count(void);
+
+const struct device *hs300x_get_stats(size_t idx, struct sensor_read_stats *stats);
+
+/* Blocking sensor_sample_fetch() + sensor_channel_get() of temperature and humidity */
+int sensor_fetch_scaled(const struct device *dev, uint32_t *temp_scaled, uint32_t *hum_scaled);
+
+/* Returns the cached sample of dev, fetching it only when older than the cache TTL */
+int sensor_cache_read(const struct device *dev, sensor_fetch_fn fetch,
+                      uint32_t *temp_scaled, uint32_t *hum_scaled);
+
+/* Returns the device of cache entry idx, or NULL past the last registered sensor */
+const struct device *sensor_cache_get_stats(size_t idx, struct sensor_cache_stats *stats);
+
+#endif
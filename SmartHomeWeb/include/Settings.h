@@ -0,0 +1,42 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <zephyr/kernel.h>
+#include <stdint.h>
+
+struct room_state;
+
+struct room_settings_stats {
+    uint32_t restored;                         // Rooms restored from flash at boot
+    uint32_t changes;                          // Setting changes reported by the controller
+    uint32_t writes;                           // Records written to flash
+    uint32_t write_bytes;                      // Bytes of those records
+    uint32_t unchanged;                        // Saves skipped, flash already held the value
+    uint32_t write_errors;                     // Failed writes, retried after the save delay
+};
+
+#if defined(CONFIG_SMARTHOME_SETTINGS)
+/* Loads the saved settings and hands them to the rooms, call before room_controller_start() */
+int room_settings_load(void);
+
+/* Called by the controller with the room's own state when a saved setting changes,
+ * the snapshot may not be published yet. The write happens
+ * CONFIG_SMARTHOME_SETTINGS_SAVE_DELAY_MS later, together with every other change.
+ */
+void room_settings_changed(uint8_t room_id, const struct room_state *state);
+
+void get_room_settings_stats(struct room_settings_stats *stats);
+#else
+static inline int room_settings_load(void) {
+    return 0;
+}
+
+static inline void room_settings_changed(uint8_t room_id, const struct room_state *state) {
+}
+
+static inline void get_room_settings_stats(struct room_settings_stats *stats) {
+    *stats = (struct room_settings_stats){ 0 };
+}
+#endif
+
+#endif
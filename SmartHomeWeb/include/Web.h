@@ -0,0 +1,28 @@
+#ifndef WEB_H
+#define WEB_H
+
+#include <zephyr/kernel.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_WS_CLIENTS CONFIG_SMARTHOME_WS_MAX_CLIENTS
+
+/* Selected by the endpoint: "/ws" sends JSON text frames, "/ws/bin" binary records */
+enum ws_protocol {
+    WS_PROTOCOL_JSON,
+    WS_PROTOCOL_BINARY,
+    WS_PROTOCOL_COUNT
+};
+
+struct ws_client_stats {
+    bool connected;                            // Slot currently holds a client
+    enum ws_protocol protocol;                 // Frame format of the client
+    uint8_t queue_depth;                       // Frames waiting to be sent
+    uint8_t max_queue_depth;                   // High-water mark of the queue
+    uint32_t drops;                            // Frames dropped because the queue was full
+    uint32_t disconnects;                      // Clients dropped from this slot
+};
+
+int ws_get_client_stats(int slot, struct ws_client_stats *stats);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef WS_ENCODE_H
+#define WS_ENCODE_H
+
+#include <zephyr/data/json.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Messages pushed to the WebSocket clients, one per web event */
+struct room_light_command {
+	int room_id;
+	int light_value;
+};
+extern const struct json_obj_descr room_light_command_descr[2];
+
+// JSON commands for temperature and humidity only for reading
+struct room_temp_read_command {
+	int room_id;
+	int temp_value;
+	int hum_value;
+};
+extern const struct json_obj_descr room_temp_command_descr[3];
+
+// JSON commands for temperature setting
+struct room_temp_set_command {
+	int room_id;
+	int setpoint_temp_value;
+};
+extern const struct json_obj_descr room_temp_set_command_descr[2];
+
+struct room_temp_heat_relay_command {
+	int room_id;
+	bool heat_relay_state;
+};
+extern const struct json_obj_descr room_temp_heat_relay_command_descr[2];
+
+/* Specialized encoders of the messages above. Each one writes the same bytes as
+ * json_obj_encode_buf() with the matching descriptor, without the terminating NUL,
+ * and returns the length or -ENOMEM when buf_len can't hold the longest message.
+ */
+int ws_encode_room_light(uint8_t *buf, size_t buf_len, int32_t room_id, int32_t light_value);
+
+int ws_encode_room_temp_read(uint8_t *buf, size_t buf_len, int32_t room_id, int32_t temp_value,
+			     int32_t hum_value);
+
+int ws_encode_room_temp_set(uint8_t *buf, size_t buf_len, int32_t room_id, int32_t setpoint_temp_value);
+
+int ws_encode_room_temp_heat_relay(uint8_t *buf, size_t buf_len, int32_t room_id, int32_t heat_relay_state);
+
+#endif
@@ -0,0 +1,128 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "Room.h"
+#include "Fade.h"
+
+LOG_MODULE_REGISTER(fade, LOG_LEVEL_INF);
+
+/* Brightness is tracked in permille so short fades still move smoothly */
+#define FADE_FULL_SCALE 1000
+#define FADE_STEP MAX(1, FADE_FULL_SCALE * CONFIG_SMARTHOME_FADE_TICK_MS / CONFIG_SMARTHOME_FADE_TIME_MS)
+
+struct fade_channel {
+    const struct pwm_dt_spec *pwm;             // NULL for a free slot
+    uint16_t level;                            // Current brightness, permille
+    uint16_t target;                           // Brightness being faded to, permille
+};
+
+static void fade_tick(struct k_timer *timer);
+
+/* All channels step on this one timer, it only runs while a fade is active */
+static K_TIMER_DEFINE(fade_timer, fade_tick, NULL);
+static struct k_spinlock fade_lock;
+static struct fade_channel fade_channels[ROOM_COUNT];
+
+#ifdef CONFIG_SMARTHOME_FADE_CURVE_GAMMA
+/* Perceived brightness to duty cycle, gamma 2.2, one entry per percent */
+static const uint16_t gamma_permille[101] = {
+       0,    0,    0,    0,    1,    1,    2,    3,    4,    5,
+       6,    8,    9,   11,   13,   15,   18,   20,   23,   26,
+      29,   32,   36,   39,   43,   47,   52,   56,   61,   66,
+      71,   76,   82,   87,   93,   99,  106,  112,  119,  126,
+     133,  141,  148,  156,  164,  173,  181,  190,  199,  208,
+     218,  227,  237,  247,  258,  268,  279,  290,  302,  313,
+     325,  337,  349,  362,  375,  388,  401,  414,  428,  442,
+     456,  471,  485,  500,  516,  531,  547,  563,  579,  595,
+     612,  629,  646,  664,  681,  699,  718,  736,  755,  774,
+     793,  813,  832,  852,  873,  893,  914,  935,  957,  978,
+    1000,
+};
+
+static uint32_t fade_duty(uint16_t level) {
+    size_t idx = level / 10;
+    uint32_t frac = level % 10;
+
+    if (idx >= ARRAY_SIZE(gamma_permille) - 1) {
+        return FADE_FULL_SCALE;
+    }
+    return gamma_permille[idx] + (gamma_permille[idx + 1] - gamma_permille[idx]) * frac / 10;
+}
+#else
+static uint32_t fade_duty(uint16_t level) {
+    return level;
+}
+#endif
+
+static void fade_apply(const struct fade_channel *ch) {
+    uint32_t pulse = (uint64_t)ch->pwm->period * fade_duty(ch->level) / FADE_FULL_SCALE;
+
+    // The PWM drivers used here only write the compare register, this is safe in the timer ISR
+    pwm_set_dt(ch->pwm, ch->pwm->period, pulse);
+}
+
+static void fade_tick(struct k_timer *timer) {
+    k_spinlock_key_t key = k_spin_lock(&fade_lock);
+    bool active = false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(fade_channels); i++) {
+        struct fade_channel *ch = &fade_channels[i];
+
+        if (ch->pwm == NULL || ch->level == ch->target) {
+            continue;
+        }
+
+        if (ch->level < ch->target) {
+            ch->level = MIN(ch->level + FADE_STEP, ch->target);
+        } else {
+            ch->level = MAX(ch->level - FADE_STEP, ch->target);
+        }
+        fade_apply(ch);
+        active |= ch->level != ch->target;
+    }
+
+    // Stopped under the lock so a concurrent light_fade_to() can't be lost
+    if (!active) {
+        k_timer_stop(timer);
+    }
+    k_spin_unlock(&fade_lock, key);
+}
+
+int light_fade_to(const struct pwm_dt_spec *pwm, uint8_t percent) {
+    struct fade_channel *ch = NULL;
+    int ret = 0;
+    k_spinlock_key_t key = k_spin_lock(&fade_lock);
+
+    for (size_t i = 0; i < ARRAY_SIZE(fade_channels); i++) {
+        if (fade_channels[i].pwm == pwm) {
+            ch = &fade_channels[i];
+            break;
+        }
+        if (ch == NULL && fade_channels[i].pwm == NULL) {
+            ch = &fade_channels[i];
+        }
+    }
+
+    if (ch == NULL) {
+        ret = -ENOMEM;
+    } else {
+        if (ch->pwm == NULL) {
+            // First use, the light is assumed off
+            ch->pwm = pwm;
+            ch->level = 0;
+        }
+        ch->target = MIN(percent, 100) * (FADE_FULL_SCALE / 100);
+
+        if (ch->level != ch->target && k_timer_remaining_ticks(&fade_timer) == 0) {
+            k_timer_start(&fade_timer, K_MSEC(CONFIG_SMARTHOME_FADE_TICK_MS),
+                          K_MSEC(CONFIG_SMARTHOME_FADE_TICK_MS));
+        }
+    }
+
+    k_spin_unlock(&fade_lock, key);
+
+    if (ret != 0) {
+        LOG_ERR("No fade channel left for %s", pwm->dev->name);
+    }
+    return ret;
+}
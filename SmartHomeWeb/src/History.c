@@ -0,0 +1,182 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+#include "Room.h"
+#include "History.h"
+
+LOG_MODULE_REGISTER(history, LOG_LEVEL_DBG);
+
+/* Fixed-memory rings per room, oldest entries are overwritten */
+struct history_ring {
+    uint16_t next;                             // Slot the next point is written to
+    uint16_t count;
+    uint32_t written;                          // Points ever stored, the sequence of the next one
+};
+
+/* Running min/avg/max of the bucket that is still open */
+struct history_acc {
+    uint32_t start_s;
+    int32_t temp_sum;
+    uint32_t hum_sum;
+    uint16_t count;
+    int16_t temp_min;
+    int16_t temp_max;
+    uint16_t hum_min;
+    uint16_t hum_max;
+};
+
+static const uint32_t bucket_span_s[HISTORY_RES_COUNT] = {
+    [HISTORY_RES_1M] = 60,
+    [HISTORY_RES_15M] = 15 * 60,
+};
+
+static struct history_point raw_points[ROOM_COUNT][CONFIG_SMARTHOME_HISTORY_RAW_SAMPLES];
+static struct history_point min1_points[ROOM_COUNT][CONFIG_SMARTHOME_HISTORY_1M_BUCKETS];
+static struct history_point min15_points[ROOM_COUNT][CONFIG_SMARTHOME_HISTORY_15M_BUCKETS];
+
+static const uint16_t ring_capacity[HISTORY_RES_COUNT] = {
+    [HISTORY_RES_RAW] = CONFIG_SMARTHOME_HISTORY_RAW_SAMPLES,
+    [HISTORY_RES_1M] = CONFIG_SMARTHOME_HISTORY_1M_BUCKETS,
+    [HISTORY_RES_15M] = CONFIG_SMARTHOME_HISTORY_15M_BUCKETS,
+};
+
+static struct history_ring rings[ROOM_COUNT][HISTORY_RES_COUNT];
+static struct history_acc accs[ROOM_COUNT][HISTORY_RES_COUNT];
+
+K_MUTEX_DEFINE(history_lock);
+
+static struct history_point *ring_points(int room_id, enum history_res res) {
+    switch (res) {
+    case HISTORY_RES_RAW:
+        return raw_points[room_id];
+    case HISTORY_RES_1M:
+        return min1_points[room_id];
+    default:
+        return min15_points[room_id];
+    }
+}
+
+static void ring_push(int room_id, enum history_res res, const struct history_point *point) {
+    struct history_ring *ring = &rings[room_id][res];
+
+    ring_points(room_id, res)[ring->next] = *point;
+    ring->next = (ring->next + 1) % ring_capacity[res];
+    ring->written++;
+    if (ring->count < ring_capacity[res]) {
+        ring->count++;
+    }
+}
+
+static void acc_close(struct history_acc *acc, int room_id, enum history_res res) {
+    struct history_point point = {
+        .time_s = acc->start_s,
+        .temp_min = acc->temp_min,
+        .temp_avg = acc->temp_sum / acc->count,
+        .temp_max = acc->temp_max,
+        .hum_min = acc->hum_min,
+        .hum_avg = acc->hum_sum / acc->count,
+        .hum_max = acc->hum_max,
+    };
+
+    ring_push(room_id, res, &point);
+    acc->count = 0;
+}
+
+static void acc_add(int room_id, enum history_res res, const struct history_point *sample) {
+    struct history_acc *acc = &accs[room_id][res];
+    uint32_t start_s = sample->time_s - (sample->time_s % bucket_span_s[res]);
+
+    if (acc->count > 0 && acc->start_s != start_s) {
+        acc_close(acc, room_id, res);
+    }
+
+    if (acc->count == 0) {
+        acc->start_s = start_s;
+        acc->temp_sum = 0;
+        acc->hum_sum = 0;
+        acc->temp_min = sample->temp_avg;
+        acc->temp_max = sample->temp_avg;
+        acc->hum_min = sample->hum_avg;
+        acc->hum_max = sample->hum_avg;
+    }
+
+    acc->temp_sum += sample->temp_avg;
+    acc->hum_sum += sample->hum_avg;
+    acc->count++;
+    acc->temp_min = MIN(acc->temp_min, sample->temp_avg);
+    acc->temp_max = MAX(acc->temp_max, sample->temp_avg);
+    acc->hum_min = MIN(acc->hum_min, sample->hum_avg);
+    acc->hum_max = MAX(acc->hum_max, sample->hum_avg);
+}
+
+void history_add_sample(int room_id, uint32_t temp_scaled, uint32_t hum_scaled) {
+    if (room_id < 0 || room_id >= ROOM_COUNT) {
+        return;
+    }
+
+    /* Sensor values are passed unsigned but hold a signed temperature */
+    int16_t temp = (int16_t)(int32_t)temp_scaled;
+    uint16_t hum = (uint16_t)hum_scaled;
+    struct history_point sample = {
+        .time_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC),
+        .temp_min = temp, .temp_avg = temp, .temp_max = temp,
+        .hum_min = hum, .hum_avg = hum, .hum_max = hum,
+    };
+
+    k_mutex_lock(&history_lock, K_FOREVER);
+    ring_push(room_id, HISTORY_RES_RAW, &sample);
+    for (int res = HISTORY_RES_1M; res < HISTORY_RES_COUNT; res++) {
+        acc_add(room_id, res, &sample);
+    }
+    k_mutex_unlock(&history_lock);
+}
+
+int history_range(int room_id, enum history_res res, uint32_t *first, uint32_t *end) {
+    if (room_id < 0 || room_id >= ROOM_COUNT || res >= HISTORY_RES_COUNT) {
+        return -EINVAL;
+    }
+
+    const struct history_ring *ring = &rings[room_id][res];
+
+    k_mutex_lock(&history_lock, K_FOREVER);
+    *end = ring->written;
+    *first = ring->written - ring->count;
+    k_mutex_unlock(&history_lock);
+    return 0;
+}
+
+int history_read(int room_id, enum history_res res, uint32_t seq, struct history_point *point) {
+    if (room_id < 0 || room_id >= ROOM_COUNT || res >= HISTORY_RES_COUNT) {
+        return -EINVAL;
+    }
+
+    int rc = -ENOENT;
+    const struct history_ring *ring = &rings[room_id][res];
+
+    k_mutex_lock(&history_lock, K_FOREVER);
+    // Distance back from the newest, wraps to a huge value for a sequence not stored yet
+    uint32_t age = ring->written - 1 - seq;
+    if (age < ring->count) {
+        uint16_t capacity = ring_capacity[res];
+        *point = ring_points(room_id, res)[(ring->next + capacity - 1 - age) % capacity];
+        rc = 0;
+    }
+    k_mutex_unlock(&history_lock);
+    return rc;
+}
+
+enum history_res history_res_from_str(const char *str, size_t len) {
+    static const char *const names[HISTORY_RES_COUNT] = {
+        [HISTORY_RES_RAW] = "raw",
+        [HISTORY_RES_1M] = "1m",
+        [HISTORY_RES_15M] = "15m",
+    };
+
+    for (int res = 0; res < HISTORY_RES_COUNT; res++) {
+        if (strlen(names[res]) == len && strncmp(names[res], str, len) == 0) {
+            return res;
+        }
+    }
+    return HISTORY_RES_COUNT;
+}
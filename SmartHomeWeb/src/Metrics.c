@@ -0,0 +1,329 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/sys_heap.h>
+#include <errno.h>
+#include <string.h>
+
+#include "Metrics.h"
+#include "Web.h"
+
+LOG_MODULE_REGISTER(metrics, LOG_LEVEL_INF);
+
+static const uint32_t latency_bounds_us[LATENCY_BUCKET_COUNT] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+};
+
+/* The same bounds as Prometheus "le" labels, in seconds */
+static const char *const latency_bounds_s[LATENCY_BUCKET_COUNT] = {
+    "0.00005", "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005",
+    "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1",
+};
+
+static const char *const latency_stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_EVENT_QUEUE] = "event_queue",
+    [LATENCY_EVENT_ACTION] = "event_action",
+    [LATENCY_EVENT_TOTAL] = "event_total",
+    [LATENCY_WEB_EVENT_QUEUE] = "web_event_queue",
+    [LATENCY_WEB_EVENT_SEND] = "web_event_send",
+    [LATENCY_WEB_EVENT_TOTAL] = "web_event_total",
+};
+
+/* Written by the executor and the WebSocket thread, read by the HTTP server and the shell */
+static struct latency_histogram latency_histograms[LATENCY_STAGE_COUNT];
+static struct k_spinlock latency_lock;
+
+void latency_record(enum latency_stage stage, uint32_t start_cycles) {
+    if (start_cycles == 0) {
+        return;
+    }
+
+    uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - start_cycles);
+    size_t bucket = 0;
+
+    while (bucket < LATENCY_BUCKET_COUNT && latency_us > latency_bounds_us[bucket]) {
+        bucket++;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&latency_lock);
+    struct latency_histogram *h = &latency_histograms[stage];
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum_us += latency_us;
+    k_spin_unlock(&latency_lock, key);
+}
+
+extern struct sys_heap _system_heap; // The default system heap
+
+static void thread_metrics_add(const struct k_thread *thread, void *user_data) {
+    struct metrics_snapshot *snap = user_data;
+
+    if (snap->thread_count == ARRAY_SIZE(snap->threads)) {
+        return;
+    }
+
+    struct thread_metrics *t = &snap->threads[snap->thread_count++];
+    const char *name = k_thread_name_get((k_tid_t)thread);
+
+    if (name != NULL && name[0] != '\0') {
+        strncpy(t->name, name, sizeof(t->name) - 1);
+        t->name[sizeof(t->name) - 1] = '\0';
+    } else {
+        snprintk(t->name, sizeof(t->name), "%p", thread);
+    }
+
+    size_t unused = 0;
+    t->stack_size = thread->stack_info.size;
+    t->stack_unused = k_thread_stack_space_get(thread, &unused) == 0 ? unused : 0;
+
+    k_thread_runtime_stats_t rt;
+    t->cycles = k_thread_runtime_stats_get((k_tid_t)thread, &rt) == 0 ? rt.execution_cycles : 0;
+}
+
+void metrics_snapshot_take(struct metrics_snapshot *snap) {
+    k_spinlock_key_t key = k_spin_lock(&latency_lock);
+    memcpy(snap->latency, latency_histograms, sizeof(snap->latency));
+    k_spin_unlock(&latency_lock, key);
+
+    sys_heap_runtime_stats_get(&_system_heap, &snap->heap);
+    get_events_fifo_stats(&snap->events_fifo);
+    get_web_events_fifo_stats(&snap->web_events_fifo);
+
+    for (int i = 0; i < ROOM_COUNT; i++) {
+        get_room_counters(i, &snap->rooms[i]);
+    }
+
+    get_room_settings_stats(&snap->settings);
+
+    snap->ws_clients = 0;
+    for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+        struct ws_client_stats ws;
+        if (ws_get_client_stats(i, &ws) == 0 && ws.connected) {
+            snap->ws_clients++;
+        }
+    }
+
+    k_thread_runtime_stats_t all;
+    snap->total_cycles = k_thread_runtime_stats_all_get(&all) == 0 ? all.execution_cycles : 0;
+
+    // Scanning the stacks for their high-water mark takes a while, don't hold the thread list lock
+    snap->thread_count = 0;
+    k_thread_foreach_unlocked(thread_metrics_add, snap);
+}
+
+/* Per stage: the buckets including +Inf, _sum and _count */
+#define LATENCY_LINES_PER_STAGE (LATENCY_BUCKET_COUNT + 3)
+
+static size_t latency_samples(const struct metrics_snapshot *snap) {
+    return LATENCY_STAGE_COUNT * LATENCY_LINES_PER_STAGE;
+}
+
+static int latency_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                          char *buf, size_t len) {
+    size_t stage = idx / LATENCY_LINES_PER_STAGE;
+    size_t line = idx % LATENCY_LINES_PER_STAGE;
+    const struct latency_histogram *h = &snap->latency[stage];
+    const char *stage_name = latency_stage_names[stage];
+
+    if (line <= LATENCY_BUCKET_COUNT) {
+        uint32_t cumulative = 0;
+        for (size_t i = 0; i <= line; i++) {
+            cumulative += h->buckets[i];
+        }
+        return snprintk(buf, len, "%s_bucket{stage=\"%s\",le=\"%s\"} %u", name, stage_name,
+                        line < LATENCY_BUCKET_COUNT ? latency_bounds_s[line] : "+Inf", cumulative);
+    }
+    if (line == LATENCY_BUCKET_COUNT + 1) {
+        return snprintk(buf, len, "%s_sum{stage=\"%s\"} %u.%06u", name, stage_name,
+                        (uint32_t)(h->sum_us / USEC_PER_SEC), (uint32_t)(h->sum_us % USEC_PER_SEC));
+    }
+    return snprintk(buf, len, "%s_count{stage=\"%s\"} %u", name, stage_name, h->count);
+}
+
+static size_t single_sample(const struct metrics_snapshot *snap) {
+    return 1;
+}
+
+static int heap_free_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                            char *buf, size_t len) {
+    return snprintk(buf, len, "%s %zu", name, snap->heap.free_bytes);
+}
+
+static int heap_allocated_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                 char *buf, size_t len) {
+    return snprintk(buf, len, "%s %zu", name, snap->heap.allocated_bytes);
+}
+
+static int heap_allocated_max_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                     char *buf, size_t len) {
+    return snprintk(buf, len, "%s %zu", name, snap->heap.max_allocated_bytes);
+}
+
+static int ws_clients_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                             char *buf, size_t len) {
+    return snprintk(buf, len, "%s %u", name, snap->ws_clients);
+}
+
+static size_t fifo_samples(const struct metrics_snapshot *snap) {
+    return 2;
+}
+
+static int fifo_depth_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                             char *buf, size_t len) {
+    const struct fifo_stats *fifo = idx == 0 ? &snap->events_fifo : &snap->web_events_fifo;
+    return snprintk(buf, len, "%s{fifo=\"%s\"} %u", name,
+                    idx == 0 ? "events_fifo" : "web_events_fifo", fifo->depth);
+}
+
+static int fifo_peak_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                            char *buf, size_t len) {
+    const struct fifo_stats *fifo = idx == 0 ? &snap->events_fifo : &snap->web_events_fifo;
+    return snprintk(buf, len, "%s{fifo=\"%s\"} %u", name,
+                    idx == 0 ? "events_fifo" : "web_events_fifo", fifo->peak);
+}
+
+static size_t room_samples(const struct metrics_snapshot *snap) {
+    return ROOM_COUNT;
+}
+
+static int climate_samples_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                  char *buf, size_t len) {
+    return snprintk(buf, len, "%s{room=\"%s\"} %u", name, get_room_by_id(idx)->room_name,
+                    snap->rooms[idx].climate_samples);
+}
+
+static int heat_relay_switches_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                      char *buf, size_t len) {
+    return snprintk(buf, len, "%s{room=\"%s\"} %u", name, get_room_by_id(idx)->room_name,
+                    snap->rooms[idx].heat_relay_switches);
+}
+
+static int settings_writes_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                  char *buf, size_t len) {
+    return snprintk(buf, len, "%s %u", name, snap->settings.writes);
+}
+
+static int settings_write_bytes_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                       char *buf, size_t len) {
+    return snprintk(buf, len, "%s %u", name, snap->settings.write_bytes);
+}
+
+static int settings_write_errors_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                        char *buf, size_t len) {
+    return snprintk(buf, len, "%s %u", name, snap->settings.write_errors);
+}
+
+static int settings_changes_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                   char *buf, size_t len) {
+    return snprintk(buf, len, "%s %u", name, snap->settings.changes);
+}
+
+static size_t thread_samples(const struct metrics_snapshot *snap) {
+    return snap->thread_count;
+}
+
+static int thread_stack_size_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                    char *buf, size_t len) {
+    const struct thread_metrics *t = &snap->threads[idx];
+    return snprintk(buf, len, "%s{thread=\"%s\"} %u", name, t->name, t->stack_size);
+}
+
+static int thread_stack_used_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                                    char *buf, size_t len) {
+    const struct thread_metrics *t = &snap->threads[idx];
+    return snprintk(buf, len, "%s{thread=\"%s\"} %u", name, t->name, t->stack_size - t->stack_unused);
+}
+
+static int thread_cpu_format(const struct metrics_snapshot *snap, const char *name, size_t idx,
+                             char *buf, size_t len) {
+    const struct thread_metrics *t = &snap->threads[idx];
+    uint32_t permyriad = snap->total_cycles ? (uint32_t)(t->cycles * 10000 / snap->total_cycles) : 0;
+    return snprintk(buf, len, "%s{thread=\"%s\"} %u.%04u", name, t->name,
+                    permyriad / 10000, permyriad % 10000);
+}
+
+/* The exposition is these families in order, each one its HELP and TYPE line and then its samples */
+static const struct metrics_family {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t (*samples)(const struct metrics_snapshot *snap);
+    int (*format)(const struct metrics_snapshot *snap, const char *name, size_t idx, char *buf, size_t len);
+} metrics_families[] = {
+    { "smarthome_latency_seconds", "histogram", "Event pipeline latency by stage",
+      latency_samples, latency_format },
+    { "smarthome_heap_free_bytes", "gauge", "Free bytes of the system heap",
+      single_sample, heap_free_format },
+    { "smarthome_heap_allocated_bytes", "gauge", "Allocated bytes of the system heap",
+      single_sample, heap_allocated_format },
+    { "smarthome_heap_allocated_max_bytes", "gauge", "Most bytes ever allocated from the system heap",
+      single_sample, heap_allocated_max_format },
+    { "smarthome_fifo_depth", "gauge", "Items queued in the event fifo",
+      fifo_samples, fifo_depth_format },
+    { "smarthome_fifo_depth_max", "gauge", "Most items ever queued in the event fifo",
+      fifo_samples, fifo_peak_format },
+    { "smarthome_climate_samples_total", "counter", "Sensor samples handled by the room controller",
+      room_samples, climate_samples_format },
+    { "smarthome_heat_relay_switches_total", "counter", "Heat relay on/off transitions",
+      room_samples, heat_relay_switches_format },
+    { "smarthome_settings_changes_total", "counter", "Room setting changes to be saved",
+      single_sample, settings_changes_format },
+    { "smarthome_settings_flash_writes_total", "counter", "Room setting records written to flash",
+      single_sample, settings_writes_format },
+    { "smarthome_settings_flash_write_bytes_total", "counter", "Bytes of room setting records written to flash",
+      single_sample, settings_write_bytes_format },
+    { "smarthome_settings_flash_write_errors_total", "counter", "Failed room setting writes",
+      single_sample, settings_write_errors_format },
+    { "smarthome_ws_clients", "gauge", "Connected WebSocket clients",
+      single_sample, ws_clients_format },
+    { "smarthome_thread_stack_size_bytes", "gauge", "Stack size of the thread",
+      thread_samples, thread_stack_size_format },
+    { "smarthome_thread_stack_used_max_bytes", "gauge", "Stack high-water mark of the thread",
+      thread_samples, thread_stack_used_format },
+    { "smarthome_thread_cpu_ratio", "gauge", "Share of the CPU time since boot spent in the thread",
+      thread_samples, thread_cpu_format },
+};
+
+static int metrics_format_family_line(const struct metrics_family *f, const struct metrics_snapshot *snap,
+                                      size_t idx, char *buf, size_t len) {
+    if (idx == 0) {
+        return snprintk(buf, len, "# HELP %s %s", f->name, f->help);
+    }
+    if (idx == 1) {
+        return snprintk(buf, len, "# TYPE %s %s", f->name, f->type);
+    }
+    return f->format(snap, f->name, idx - 2, buf, len);
+}
+
+int metrics_format_line(const struct metrics_snapshot *snap, size_t idx, char *buf, size_t len) {
+    for (size_t i = 0; i < ARRAY_SIZE(metrics_families); i++) {
+        size_t count = 2 + metrics_families[i].samples(snap);
+
+        if (idx < count) {
+            int ret = metrics_format_family_line(&metrics_families[i], snap, idx, buf, len);
+            return ret < 0 || (size_t)ret >= len ? -ENOMEM : ret;
+        }
+        idx -= count;
+    }
+    return 0;
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_metrics(const struct shell *sh, size_t argc, char **argv) {
+    static struct metrics_snapshot snap;
+    static char line[METRICS_LINE_MAX];
+    int ret;
+
+    metrics_snapshot_take(&snap);
+    for (size_t i = 0; (ret = metrics_format_line(&snap, i, line, sizeof(line))) != 0; i++) {
+        if (ret < 0) {
+            shell_error(sh, "Line %zu does not fit %d bytes", i, METRICS_LINE_MAX);
+            continue;
+        }
+        shell_print(sh, "%s", line);
+    }
+    return 0;
+}
+
+SHELL_CMD_REGISTER(metrics, NULL, "Print the /api/v1/metrics report", cmd_metrics);
+#endif
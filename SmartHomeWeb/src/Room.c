@@ -1,10 +1,86 @@
 #include "Room.h"
+#include "Sensor.h"
+#include "Fade.h"
+#include "Metrics.h"
+#include "Settings.h"
+
+#include <zephyr/sys/barrier.h>
 
 LOG_MODULE_REGISTER(room, LOG_LEVEL_DBG);
 
 K_FIFO_DEFINE(events_fifo);
 K_FIFO_DEFINE(web_events_fifo);
 
+/* Fixed-block pools for the event path, so it never touches the system heap */
+K_MEM_SLAB_DEFINE_STATIC(event_slab, sizeof(struct Event),
+                         CONFIG_SMARTHOME_EVENT_POOL_SIZE, sizeof(void *));
+/* A batch may switch every one of its lights and relays before the first event is
+ * executed, while the climate samples of the same round switch up to one relay per room
+ */
+BUILD_ASSERT(CONFIG_SMARTHOME_EVENT_POOL_SIZE >= CONFIG_SMARTHOME_BATCH_MAX_COMMANDS + ROOM_COUNT,
+             "CONFIG_SMARTHOME_EVENT_POOL_SIZE can't hold a full batch");
+K_MEM_SLAB_DEFINE_STATIC(web_event_slab, sizeof(struct WebEvent),
+                         CONFIG_SMARTHOME_WEB_EVENT_POOL_SIZE, sizeof(void *));
+
+static atomic_t event_alloc_failures;
+static atomic_t web_event_alloc_failures;
+
+/* Depth of the fifos, raised by room_events_flush() and lowered by event_get()/web_event_get().
+ * The peaks are only written by the controller thread.
+ */
+static atomic_t events_fifo_depth;
+static atomic_t events_fifo_peak;
+static atomic_t web_events_fifo_depth;
+static atomic_t web_events_fifo_peak;
+
+/* All room state is owned by the controller thread. Other threads post commands
+ * to room_mailbox and read the state from the published snapshot, which the
+ * controller copies out after handling everything queued.
+ */
+enum room_command_type {
+    ROOM_CMD_CLIMATE,
+    ROOM_CMD_LIGHT,
+    ROOM_CMD_HEAT_RELAY,
+    ROOM_CMD_BATCH,
+};
+
+/* Filled in by the controller for a poster waiting on its command */
+struct room_result {
+    struct k_sem done;
+    int ret;
+};
+
+struct room_command {
+    uint8_t type;                              // enum room_command_type
+    uint8_t room_id;
+    uint16_t hum;                              // Humidity of a climate sample, 0.01 %RH
+    int32_t value;                             // Temperature, light value, relay state or number of ops
+    uint32_t input_cycles;                     // Cycle count of the switch edge, 0 if none
+    uint32_t origin_cycles;                    // The switch edge, or when the command was posted
+    struct room_result *result;                // NULL unless the poster waits for the outcome
+    struct room_op *ops;                       // Ops of a ROOM_CMD_BATCH, value is their count
+};
+
+K_MSGQ_DEFINE(room_mailbox, sizeof(struct room_command), CONFIG_SMARTHOME_ROOM_MAILBOX_SIZE, 4);
+
+#define ROOM_CONTROLLER_STACKSIZE 1024
+#define ROOM_CONTROLLER_PRIORITY 6
+
+/* Events registered by the controller are collected here and handed to the fifos
+ * in one put each, once the snapshot holding their state is published.
+ */
+static sys_slist_t pending_events;
+static sys_slist_t pending_web_events;
+static size_t pending_event_count;
+static size_t pending_web_event_count;
+static bool state_dirty;
+static uint32_t command_origin_cycles;         // Origin of the command being handled
+
+/* Seqlock over published_states: odd while the controller copies a new snapshot,
+ * half of it is the version of the snapshot
+ */
+static atomic_t snapshot_seq = ATOMIC_INIT(2);
+
 #define LED0_NODE DT_ALIAS(led0)
 #define LED1_NODE DT_ALIAS(led1)
 #define LED2_NODE DT_ALIAS(led2)
@@ -15,138 +91,102 @@ static const struct gpio_dt_spec leds[ROOM_LED_COUNT] = {
     GPIO_DT_SPEC_GET(LED2_NODE, gpios),
 };
 
-#define DHT0_ALIAS DT_ALIAS(dht0)
-#define DHT1_ALIAS DT_ALIAS(dht1)
-
-static const struct device *const dht_devices[] = {
-    DEVICE_DT_GET(DHT0_ALIAS),
-    DEVICE_DT_GET(DHT1_ALIAS),
+#define ROOM_DEVICE_OR_NULL(node, prop)                                        \
+    COND_CODE_1(DT_NODE_HAS_PROP(node, prop),                                  \
+                (DEVICE_DT_GET(DT_PHANDLE(node, prop))), (NULL))
+
+#define ROOM_STATE(node)                                                       \
+    [DT_NODE_CHILD_IDX(node)] = {                                              \
+        .temp_sensor_value = 2200,                                             \
+        .hum_sensor_value = 2200,                                              \
+        .desired_temperature = DT_PROP(node, desired_temperature),             \
+        .temperature_offset = DT_PROP(node, temperature_offset),               \
+    },
+
+#define ROOM_DESC(node)                                                        \
+    [DT_NODE_CHILD_IDX(node)] = {                                              \
+        .room_id = DT_NODE_CHILD_IDX(node),                                    \
+        .room_name = DT_PROP(node, room_name),                                 \
+        .light_switch = GPIO_DT_SPEC_GET_OR(node, switch_gpios, {0}),          \
+        .light_pwm = PWM_DT_SPEC_GET_OR(node, {0}),                            \
+        .light_gpio = GPIO_DT_SPEC_GET_OR(node, light_gpios, {0}),             \
+        .hs300x = ROOM_DEVICE_OR_NULL(node, hs300x),                           \
+        .temp_dht11 = ROOM_DEVICE_OR_NULL(node, dht11),                        \
+        .heat_relay = GPIO_DT_SPEC_GET_OR(node, heat_relay_gpios, {0}),        \
+    },
+
+BUILD_ASSERT(ROOM_COUNT > 0 && ROOM_COUNT <= UINT8_MAX,
+             "The rooms node needs between 1 and 255 children");
+
+/* Only touched by the controller thread */
+static struct room_state room_states[ROOM_COUNT] = {
+    DT_FOREACH_CHILD(ROOMS_NODE, ROOM_STATE)
 };
 
-static const struct pwm_dt_spec lr_pwdled = PWM_DT_SPEC_GET(DT_ALIAS(pwmlivingroom));
-static const struct pwm_dt_spec kr_pwdled = PWM_DT_SPEC_GET(DT_ALIAS(pwmkitchen));
-
-static const struct gpio_dt_spec lr_gpio_switch = GPIO_DT_SPEC_GET_OR(DT_ALIAS(switchlivingroom), gpios, {0});
-static const struct gpio_dt_spec kr_gpio_switch = GPIO_DT_SPEC_GET_OR(DT_ALIAS(switchkitchen), gpios, {0});
-
-static const struct gpio_dt_spec lr_gpio_relay_temp = GPIO_DT_SPEC_GET_OR(DT_ALIAS(temprelaylivingroom), gpios, {0});
-static const struct gpio_dt_spec kr_gpio_relay_temp = GPIO_DT_SPEC_GET_OR(DT_ALIAS(temprelaykitchen), gpios, {0});
-
-/* RTIO devices for reading temperature/humidity channels */
-SENSOR_DT_READ_IODEV(dht_iodev0,
-                     DHT0_ALIAS,
-                     { SENSOR_CHAN_AMBIENT_TEMP, 0 },
-                     { SENSOR_CHAN_HUMIDITY, 0 });
-
-SENSOR_DT_READ_IODEV(dht_iodev1,
-                     DHT1_ALIAS,
-                     { SENSOR_CHAN_AMBIENT_TEMP, 0 },
-                     { SENSOR_CHAN_HUMIDITY, 0 });
-
-RTIO_DEFINE(dht_ctx, 1, 1);
-
-/* DHT11 temp sensor */\
-#define DHT11_NODE DT_ALIAS(dht11)
-static const struct device *const dht11_temp_sensor = DEVICE_DT_GET(DHT11_NODE);
-
-
-
-static struct Room lr_room  = { 
-    .room_id = LIVINROOM_ROOM,
-    .room_name = "Living Room",
-    .light_switch = &lr_gpio_switch, 
-    .light_gpio = &leds[ROOM_LED_ERROR], 
-    .light_pwm = NULL, 
-    .light_gpio_value = 0,
-    .dht_devices = dht_devices[0],
-    .dht_iodevs = &dht_iodev0,
-    .temp_sensor_value = 2200,
-    .hum_sensor_value = 2200,
-    .desired_temperature = 2200,
-    .heat_relay = &lr_gpio_relay_temp,
-    .heat_relay_state = false,
-    .offset_desired_temperature = 50,
-    .temp_dht11 = dht11_temp_sensor,
-};
-static struct Room kr_room = { 
-    .room_id = KITCHEN_ROOM,
-    .room_name = "Kitchen",
-    .light_switch = &kr_gpio_switch, 
-    .light_gpio = NULL, 
-    .light_pwm = &kr_pwdled, 
-    .light_gpio_value = 0,
-    .dht_devices = dht_devices[1],
-    .dht_iodevs = &dht_iodev1,
-    .temp_sensor_value = 2200,
-    .hum_sensor_value = 2200,
-    .desired_temperature = 2200,
-    .heat_relay = &kr_gpio_relay_temp,
-    .heat_relay_state = false,
-    .offset_desired_temperature = 50,
-    .temp_dht11 = dht11_temp_sensor,
+/* What readers see, only written by room_snapshot_publish() */
+static struct room_state published_states[ROOM_COUNT] = {
+    DT_FOREACH_CHILD(ROOMS_NODE, ROOM_STATE)
 };
 
-static struct Room *rooms[STRUCT_ROOM_COUNT] = { 
-    &lr_room, 
-    &kr_room 
+/* Written by the controller thread, read by the metrics */
+static atomic_t climate_samples[ROOM_COUNT];
+static atomic_t heat_relay_switches[ROOM_COUNT];
+
+static const struct Room rooms[ROOM_COUNT] = {
+    DT_FOREACH_CHILD(ROOMS_NODE, ROOM_DESC)
 };
 
-bool room_device_init() {
-    int ret = 0;
+static bool room_gpio_init(const struct gpio_dt_spec *gpio, gpio_flags_t flags) {
+    if (gpio->port == NULL) {
+        return true;
+    }
+    if (!gpio_is_ready_dt(gpio)) {
+        LOG_ERR("GPIO %s not ready", gpio->port->name);
+        return false;
+    }
+
+    int ret = gpio_pin_configure_dt(gpio, flags);
+    if (ret != 0) {
+        LOG_ERR("Configuring GPIO %s pin %d failed: %d", gpio->port->name, gpio->pin, ret);
+        return false;
+    }
+    return true;
+}
+
+static bool room_sensor_ready(const struct device *dev) {
+    if (dev != NULL && !device_is_ready(dev)) {
+        LOG_ERR("Sensor %s not ready", dev->name);
+        return false;
+    }
+    return true;
+}
 
+bool room_device_init(void) {
     /* Leds init */
     for (int i = 0; i < ROOM_LED_COUNT; i++) {
-        if (!gpio_is_ready_dt(&leds[i])) return false;
-        gpio_pin_configure_dt(&leds[i], GPIO_OUTPUT_ACTIVE);
+        if (!room_gpio_init(&leds[i], GPIO_OUTPUT_ACTIVE)) return false;
     }
 
-    /* PWM signal for leds init */
-    static const struct pwm_dt_spec pwd_lights[] = { lr_pwdled, kr_pwdled };
-    for (size_t i = 0; i < ARRAY_SIZE(pwd_lights); i++) {
+    for (size_t i = 0; i < ARRAY_SIZE(rooms); i++) {
+        const struct Room *room = &rooms[i];
 
-        if (!pwm_is_ready_dt(&pwd_lights[i])){
-            LOG_ERR("PWM device not ready");
+        /* Outputs start inactive to match the initial room state */
+        if (!room_gpio_init(&room->light_switch, GPIO_INPUT) ||
+            !room_gpio_init(&room->light_gpio, GPIO_OUTPUT_INACTIVE) ||
+            !room_gpio_init(&room->heat_relay, GPIO_OUTPUT_INACTIVE)) {
             return false;
         }
-    }
 
-    /* INPUT GPIO init */
-    const struct gpio_dt_spec *input_gpio[] = { &lr_gpio_switch, &kr_gpio_switch};
-    int number_of_switches = sizeof(input_gpio) / sizeof(struct gpio_dt_spec*);
-    for (int i = 0; i < number_of_switches; i++) {
-        if (!gpio_is_ready_dt(input_gpio[i])) return 0;
-        ret = gpio_pin_configure_dt(input_gpio[i], GPIO_INPUT | input_gpio[i]->dt_flags);
-        if (ret != 0) {
-            LOG_ERR("Configuring INPUT GPIO pin failed: %d", ret);
+        if (room->light_pwm.dev != NULL && !pwm_is_ready_dt(&room->light_pwm)) {
+            LOG_ERR("PWM device not ready");
             return false;
         }
-    }
 
-    /* OUTPUT GPIO init */
-    const struct gpio_dt_spec *output_gpio[] = { &lr_gpio_relay_temp, &kr_gpio_relay_temp};
-    int number_of_out = sizeof(output_gpio) / sizeof(struct gpio_dt_spec*);
-    for (int i = 0; i < number_of_out; i++) {
-        if (!gpio_is_ready_dt(output_gpio[i])) return 0;
-        ret = gpio_pin_configure_dt(output_gpio[i], GPIO_OUTPUT_ACTIVE);
-        if (ret != 0) {
-            LOG_ERR("Configuring OUTPUT GPIO pin failed: %d", ret);
+        if (!room_sensor_ready(room->hs300x) || !room_sensor_ready(room->temp_dht11)) {
             return false;
         }
     }
 
-    /* Temp sensor init */
-    for (size_t i = 0; i < ARRAY_SIZE(dht_devices); i++) {
-		if (!device_is_ready(dht_devices[i])) {
-			printk("sensor: device %s not ready.\n", dht_devices[i]->name);
-			return 0;
-		}
-	}
-
-    if (!device_is_ready(dht11_temp_sensor)) {
-        printk("Sensor dht11 device not ready!\n");
-        return;
-    }
-
 	LOG_INF("Initialization and configuration switch done.");
     return true;
 }
@@ -160,59 +200,249 @@ void gpio_event_action(void *ctx, uint32_t value)
 void pwm_event_action(void *ctx, uint32_t value)
 {
     const struct pwm_dt_spec *pwm = ctx;
-    pwm_set_dt(pwm, pwm->period, value);
+    light_fade_to(pwm, MIN(value, 100));
+}
+
+static void room_snapshot_publish(void) {
+    // The scheduler lock keeps readers from preempting a half written copy, so on
+    // one core they never retry. On SMP they spin for the length of a memcpy.
+    k_sched_lock();
+    atomic_inc(&snapshot_seq);
+    barrier_dmem_fence_full();
+    memcpy(published_states, room_states, sizeof(published_states));
+    barrier_dmem_fence_full();
+    atomic_inc(&snapshot_seq);
+    k_sched_unlock();
+}
+
+static uint32_t room_snapshot_copy(void *dst, const void *src, size_t len) {
+    atomic_val_t seq;
+
+    do {
+        seq = atomic_get(&snapshot_seq);
+        barrier_dmem_fence_full();
+        memcpy(dst, src, len);
+        barrier_dmem_fence_full();
+    } while ((seq & 1) || seq != atomic_get(&snapshot_seq));
+
+    return (uint32_t)seq / 2;
+}
+
+uint32_t room_state_version(void) {
+    return (uint32_t)atomic_get(&snapshot_seq) / 2;
+}
+
+uint32_t room_snapshot_read(struct room_state states[ROOM_COUNT]) {
+    return room_snapshot_copy(states, published_states, sizeof(published_states));
 }
 
-struct Room** get_all_rooms() {
-    return rooms;
+bool room_state_get(int id, struct room_state *state) {
+    if (id < 0 || id >= ROOM_COUNT) {
+        return false;
+    }
+    room_snapshot_copy(state, &published_states[id], sizeof(*state));
+    return true;
 }
 
-struct Room* get_room_by_id(int id) {
-    return rooms[id];
+const struct Room* get_room_by_id(int id) {
+    if (id < 0 || id >= ROOM_COUNT) {
+        return NULL;
+    }
+    return &rooms[id];
 }
 
 const struct gpio_dt_spec* get_led_by_id(int id) {
+    if (id < 0 || id >= ROOM_LED_COUNT) {
+        return NULL;
+    }
     return &leds[id];
 }
 
-int register_new_event(struct Room *room, uint32_t new_value, enum VALUE_TYPE event_type, bool is_for_web_event) {
+struct Event* event_alloc(void) {
+    struct Event *event;
 
-    struct Event *new_event = k_malloc(sizeof(struct Event));
-    if (!new_event) {
-        LOG_ERR("Unable to allocate memory for event");
-        return -1;
+    if (k_mem_slab_alloc(&event_slab, (void **)&event, K_NO_WAIT) != 0) {
+        atomic_inc(&event_alloc_failures);
+        return NULL;
+    }
+    return event;
+}
+
+void event_free(struct Event *event) {
+    k_mem_slab_free(&event_slab, event);
+}
+
+struct WebEvent* web_event_alloc(void) {
+    struct WebEvent *web_event;
+
+    if (k_mem_slab_alloc(&web_event_slab, (void **)&web_event, K_NO_WAIT) != 0) {
+        atomic_inc(&web_event_alloc_failures);
+        return NULL;
+    }
+    return web_event;
+}
+
+void web_event_free(struct WebEvent *web_event) {
+    k_mem_slab_free(&web_event_slab, web_event);
+}
+
+static void fill_pool_stats(struct k_mem_slab *slab, atomic_t *failures,
+                            uint32_t capacity, struct event_pool_stats *stats) {
+    stats->used = k_mem_slab_num_used_get(slab);
+    stats->max_used = k_mem_slab_max_used_get(slab);
+    stats->capacity = capacity;
+    stats->alloc_failures = atomic_get(failures);
+}
+
+void get_event_pool_stats(struct event_pool_stats *stats) {
+    fill_pool_stats(&event_slab, &event_alloc_failures,
+                    CONFIG_SMARTHOME_EVENT_POOL_SIZE, stats);
+}
+
+void get_web_event_pool_stats(struct event_pool_stats *stats) {
+    fill_pool_stats(&web_event_slab, &web_event_alloc_failures,
+                    CONFIG_SMARTHOME_WEB_EVENT_POOL_SIZE, stats);
+}
+
+/* The first member of both event structs is reserved for the fifo, it doubles as list node */
+static void queue_event(struct Event *event) {
+    sys_slist_append(&pending_events, (sys_snode_t *)event);
+    pending_event_count++;
+}
+
+static void queue_web_event(struct WebEvent *web_event) {
+    sys_slist_append(&pending_web_events, (sys_snode_t *)web_event);
+    pending_web_event_count++;
+}
+
+static void fifo_depth_add(atomic_t *depth, atomic_t *peak, size_t count) {
+    // Raised before the put so the consumer can never take the depth below zero
+    atomic_val_t now = atomic_add(depth, count) + count;
+
+    if (now > atomic_get(peak)) {
+        atomic_set(peak, now);
+    }
+}
+
+static void room_events_flush(void) {
+    if (!sys_slist_is_empty(&pending_events)) {
+        fifo_depth_add(&events_fifo_depth, &events_fifo_peak, pending_event_count);
+        k_fifo_put_slist(&events_fifo, &pending_events);
+        sys_slist_init(&pending_events);
+        pending_event_count = 0;
+    }
+    if (!sys_slist_is_empty(&pending_web_events)) {
+        fifo_depth_add(&web_events_fifo_depth, &web_events_fifo_peak, pending_web_event_count);
+        k_fifo_put_slist(&web_events_fifo, &pending_web_events);
+        sys_slist_init(&pending_web_events);
+        pending_web_event_count = 0;
     }
+}
+
+struct Event* event_get(k_timeout_t timeout) {
+    struct Event *event = k_fifo_get(&events_fifo, timeout);
+
+    if (event != NULL) {
+        atomic_dec(&events_fifo_depth);
+    }
+    return event;
+}
+
+struct WebEvent* web_event_get(k_timeout_t timeout) {
+    struct WebEvent *web_event = k_fifo_get(&web_events_fifo, timeout);
+
+    if (web_event != NULL) {
+        atomic_dec(&web_events_fifo_depth);
+    }
+    return web_event;
+}
+
+void get_events_fifo_stats(struct fifo_stats *stats) {
+    stats->depth = atomic_get(&events_fifo_depth);
+    stats->peak = atomic_get(&events_fifo_peak);
+}
+
+void get_web_events_fifo_stats(struct fifo_stats *stats) {
+    stats->depth = atomic_get(&web_events_fifo_depth);
+    stats->peak = atomic_get(&web_events_fifo_peak);
+}
+
+bool get_room_counters(int id, struct room_counters *counters) {
+    if (id < 0 || id >= ROOM_COUNT) {
+        return false;
+    }
+    counters->climate_samples = atomic_get(&climate_samples[id]);
+    counters->heat_relay_switches = atomic_get(&heat_relay_switches[id]);
+    return true;
+}
+
+static bool register_new_web_event(uint32_t room_id, enum VALUE_TYPE value_type, uint32_t value) {
+    struct WebEvent *new_web_event = web_event_alloc();
+    if (!new_web_event) {
+        LOG_ERR("Unable to allocate memory for web event");
+        return false;
+    }
+
+    new_web_event->room_id = room_id;
+    new_web_event->value_type = value_type;
+    new_web_event->value = value;
+    new_web_event->origin_cycles = command_origin_cycles;
+    new_web_event->created_cycles = latency_stamp();
+
+    queue_web_event(new_web_event);
+    return true;
+}
+
+static int register_event(const struct Room *room, uint32_t new_value, enum VALUE_TYPE event_type,
+                          bool is_for_web_event, uint32_t input_cycles) {
 
     LOG_DBG("Registering event for room %d, type %d, value %d",
             room->room_id,
             event_type,
             new_value);
     bool isLocalEventRegistered = true;
+    struct Event *new_event = NULL;
+
     // Only light events and heat relay action are supported for now locally
+    if (event_type == LIGHT_EV || event_type == HEAT_RELAY_EV) {
+        new_event = event_alloc();
+        if (!new_event) {
+            LOG_ERR("Unable to allocate memory for event");
+            return -ENOMEM;
+        }
+        new_event->input_cycles = input_cycles;
+        new_event->origin_cycles = command_origin_cycles;
+        new_event->created_cycles = latency_stamp();
+    }
+
     if (event_type == LIGHT_EV) {
-        if (room->light_gpio != NULL) {
+        if (room->light_gpio.port != NULL) {
             new_event->action = gpio_event_action;
-            new_event->ctx = (void *)room->light_gpio;
+            new_event->ctx = (void *)&room->light_gpio;
             new_event->value = new_value ? 1 : 0;
-        } else if (room->light_pwm != NULL) {
+        } else if (room->light_pwm.dev != NULL) {
             new_event->action = pwm_event_action;
-            new_event->ctx = (void *)room->light_pwm;
+            new_event->ctx = (void *)&room->light_pwm;
             new_event->value = new_value;
         } else {
             LOG_ERR("No light actuator defined for room %d", room->room_id);
-            k_free(new_event);
-            return -1;
+            event_free(new_event);
+            return -ENODEV;
         }
-        k_fifo_put(&events_fifo, new_event);
+        queue_event(new_event);
 
     } else if (event_type == HEAT_RELAY_EV) {
         new_event->action = gpio_event_action;
-        new_event->ctx = (void *)room->heat_relay;
+        if (room->heat_relay.port == NULL) {
+            LOG_DBG("No heat relay defined for room %d", room->room_id);
+            event_free(new_event);
+            return -ENODEV;
+        }
+        new_event->ctx = (void *)&room->heat_relay;
         new_event->value = new_value ? 1 : 0;
-        k_fifo_put(&events_fifo, new_event);
+        queue_event(new_event);
     } else {
-        LOG_WRN ("Unsupported event type %d for local execution", event_type);
-        k_free(new_event);
+        LOG_DBG("Event type %d has no local action", event_type);
         isLocalEventRegistered = false;
     }
 
@@ -231,123 +461,268 @@ int register_new_event(struct Room *room, uint32_t new_value, enum VALUE_TYPE ev
     return isLocalEventRegistered ? 0 : 1;
 }
 
-bool register_new_web_event(uint32_t room_id, enum VALUE_TYPE value_type, uint32_t value) {
-    struct WebEvent *new_web_event = k_malloc(sizeof(struct WebEvent));
-    if (!new_web_event) {
-        LOG_ERR("Unable to allocate memory for web event");
-        return false;
-    }
-
-    new_web_event->room_id = room_id;
-    new_web_event->value_type = value_type;
-    new_web_event->value = value;
-
-    k_fifo_put(&web_events_fifo, new_web_event);
-    return true;
+static int register_new_event(const struct Room *room, uint32_t new_value, enum VALUE_TYPE event_type, bool is_for_web_event) {
+    return register_event(room, new_value, event_type, is_for_web_event, 0);
 }
 
-// For testing purposes only, simulating temperature and humidity readings
-static int x = 0;
-
-int read_temp_and_hum_dht11(struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled) {
+int read_temp_and_hum_dht11(const struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled) {
     if (room->temp_dht11 == NULL) {
         LOG_ERR("No DHT11 sensor defined for room %d", room->room_id);
         return -1;
     }
-    int rc = sensor_sample_fetch(room->temp_dht11);
 
+    // Rooms sharing the sensor are served from the cache, only a miss touches the wire
+    return sensor_cache_read(room->temp_dht11, sensor_fetch_scaled, temp_scaled, hum_scaled);
+}
+
+int read_temp_and_hum(const struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled) {
+    // Samples are fetched for all hs300x sensors at once by hs300x_read_all()
+    int rc = hs300x_get_sample(room->hs300x, temp_scaled, hum_scaled);
     if (rc != 0) {
-        LOG_WRN("Sensor fetch failed: %d\n", rc);
-        return rc;
+        LOG_WRN("No sample for room %d: %d", room->room_id, rc);
     }
+    return rc;
+}
 
-    struct sensor_value temperature;
-    struct sensor_value humidity;
+static int turn_on_off_temperature(const struct Room *room, bool turn_on) {
+    struct room_state *state = &room_states[room->room_id];
 
-    rc = sensor_channel_get(room->temp_dht11, SENSOR_CHAN_AMBIENT_TEMP,
-                &temperature);
-    if (rc == 0) {
-        rc = sensor_channel_get(room->temp_dht11, SENSOR_CHAN_HUMIDITY,
-                    &humidity);
+    if (turn_on == state->heat_relay_state) {
+        return 0;
     }
-    if (rc != 0) {
-        LOG_WRN("get failed: %d\n", rc);
-        return rc;
+    // Without an event the relay doesn't move, the state is kept so the next sample retries
+    if (register_new_event(room, turn_on, HEAT_RELAY_EV, true) == -ENOMEM) {
+        return -ENOMEM;
     }
-    *temp_scaled = (uint32_t)(sensor_value_to_double(&temperature) * 100);
-    *hum_scaled = (uint32_t)(sensor_value_to_double(&humidity) * 100);
+    state->heat_relay_state = turn_on;
+    state_dirty = true;
+    atomic_inc(&heat_relay_switches[room->room_id]);
     return 0;
 }
 
-int read_temp_and_hum(struct Room *room, uint32_t* temp_scaled, uint32_t* hum_scaled) {
-    //x = x + 50;
-    *temp_scaled = 2000 + x ;
-    *hum_scaled = 2000  + x - 100;
-    return 0;
+static void process_temperature_control(const struct Room *room) {
+    const struct room_state *state = &room_states[room->room_id];
 
-    int rc;
-    uint8_t buf[128];
-    struct device *dev = (struct device *) room->dht_devices;
+    if (state->temp_sensor_value < state->desired_temperature - state->temperature_offset 
+        && state->heat_relay_state == false) {
+        turn_on_off_temperature(room, true);
+    } else if (state->temp_sensor_value > state->desired_temperature + state->temperature_offset 
+        && state->heat_relay_state == true) {
+        turn_on_off_temperature(room, false);
+    }
+}
+
+static void update_climate(const struct Room *room, int16_t temp_scaled_value, uint16_t hum_scaled_value) {
+    struct room_state *state = &room_states[room->room_id];
+
+    atomic_inc(&climate_samples[room->room_id]);
+    if (temp_scaled_value != state->temp_sensor_value ||
+        hum_scaled_value != state->hum_sensor_value) {
+        register_new_event(room, temp_scaled_value, HEAT_EV, true);
+        register_new_event(room, hum_scaled_value, HUM_EV, true);
+        state->temp_sensor_value = temp_scaled_value;
+        state->hum_sensor_value = hum_scaled_value;
+        state_dirty = true;
+    }
 
-    rc = sensor_read(room->dht_iodevs, &dht_ctx, buf, sizeof(buf));
-    if (rc != 0) return rc;
+    process_temperature_control(room);
+}
 
-    const struct sensor_decoder_api *decoder;
-    sensor_get_decoder(dev, &decoder);
+static void update_setpoint(const struct Room *room, int16_t desired_temperature) {
+    struct room_state *state = &room_states[room->room_id];
 
-    // Decode Temp
-    uint32_t fit = 0;
-    struct sensor_q31_data q_data = {0};
-    
-    // Process Temperature
-    decoder->decode(buf, (struct sensor_chan_spec){SENSOR_CHAN_AMBIENT_TEMP, 0}, &fit, 1, &q_data);
-    if (fit > 0) {
-        q31_t q = q_data.readings[0].temperature;
-        int32_t whole = q >> q_data.shift;
-        int32_t frac  = ((q & ((1LL << q_data.shift) - 1)) * 100) >> q_data.shift;
-        temp_scaled = (whole * 100) + frac;
+    // Re-sending the current setpoint must not bump the snapshot version nor push a frame
+    if (desired_temperature != state->desired_temperature) {
+        register_new_event(room, desired_temperature, SETPOINT_EV, true);
+        state->desired_temperature = desired_temperature;
+        state_dirty = true;
+        room_settings_changed(room->room_id, state);
     }
+    // After setting new desired temperature, process control logic
+    process_temperature_control(room);
+}
 
-    // Process Humidity
-    decoder->decode(buf, (struct sensor_chan_spec){SENSOR_CHAN_HUMIDITY, 0}, &fit, 1, &q_data);
-    if (fit > 0) {
-        q31_t q = q_data.readings[0].humidity;
-        int32_t whole = q >> q_data.shift;
-        int32_t frac  = ((q & ((1LL << q_data.shift) - 1)) * 100) >> q_data.shift;
-        hum_scaled = (whole * 100) + frac;
+static void update_hysteresis(const struct Room *room, uint16_t temperature_offset) {
+    struct room_state *state = &room_states[room->room_id];
+
+    if (temperature_offset != state->temperature_offset) {
+        state->temperature_offset = temperature_offset;
+        state_dirty = true;
+        room_settings_changed(room->room_id, state);
     }
+    process_temperature_control(room);
+}
+
+static int turn_on_off_light(const struct Room *room, uint32_t new_light_gpio_value, uint32_t press_cycles) {
+    struct room_state *state = &room_states[room->room_id];
 
+    if (new_light_gpio_value == state->light_gpio_value) {
+        return 0;
+    }
+    if (register_event(room, new_light_gpio_value, LIGHT_EV, true, press_cycles) == -ENOMEM) {
+        return -ENOMEM;
+    }
+    state->light_gpio_value = new_light_gpio_value;
+    state_dirty = true;
+    room_settings_changed(room->room_id, state);
     return 0;
 }
 
-static void turn_on_off_temperature(struct Room *room, bool turn_on) {
-    if (turn_on && room->heat_relay_state == false) {
-        register_new_event(room, 1, HEAT_RELAY_EV, true);
-        room->heat_relay_state = true;
-    } else if (!turn_on && room->heat_relay_state == true) {
-        register_new_event(room, 0, HEAT_RELAY_EV, true);
-        room->heat_relay_state = false;
+static int room_apply_op(const struct room_op *op) {
+    switch (op->type) {
+    case ROOM_OP_LIGHT:
+        return turn_on_off_light(op->room, op->value, 0);
+    case ROOM_OP_SETPOINT:
+        update_setpoint(op->room, op->value);
+        return 0;
+    case ROOM_OP_HYSTERESIS:
+        update_hysteresis(op->room, op->value);
+        return 0;
+    case ROOM_OP_HEAT_RELAY:
+        return turn_on_off_temperature(op->room, op->value);
+    default:
+        LOG_WRN("Unknown room op %d", op->type);
+        return -EINVAL;
     }
 }
 
-void process_temperature_control(struct Room *room) {
-    if (room->temp_sensor_value < room->desired_temperature - room->offset_desired_temperature 
-        && room->heat_relay_state == false) {
-        turn_on_off_temperature(room, true);
-    } else if (room->temp_sensor_value > room->desired_temperature + room->offset_desired_temperature 
-        && room->heat_relay_state == true) {
-        turn_on_off_temperature(room, false);
+static int room_handle_command(const struct room_command *cmd) {
+    const struct Room *room = &rooms[cmd->room_id];
+    int ret = 0;
+
+    command_origin_cycles = cmd->origin_cycles;
+    switch (cmd->type) {
+    case ROOM_CMD_CLIMATE:
+        update_climate(room, cmd->value, cmd->hum);
+        break;
+    case ROOM_CMD_LIGHT:
+        ret = turn_on_off_light(room, cmd->value, cmd->input_cycles);
+        break;
+    case ROOM_CMD_HEAT_RELAY:
+        ret = turn_on_off_temperature(room, cmd->value);
+        break;
+    case ROOM_CMD_BATCH:
+        // Applied in one go, the publish after this pass holds all of them
+        for (int32_t i = 0; i < cmd->value; i++) {
+            cmd->ops[i].result = room_apply_op(&cmd->ops[i]);
+        }
+        break;
+    default:
+        LOG_WRN("Unknown room command %d", cmd->type);
+        break;
     }
+    return ret;
 }
 
-static void turn_on_off_light(struct Room *room, uint32_t new_light_gpio_value) {
-    register_new_event(room, new_light_gpio_value, LIGHT_EV, true);
-    room->light_gpio_value = new_light_gpio_value;
+static void room_post(enum room_command_type type, const struct Room *room,
+                      int32_t value, uint16_t hum, uint32_t input_cycles, struct room_result *result) {
+    struct room_command cmd = {
+        .type = type,
+        .room_id = room != NULL ? room->room_id : 0,
+        .hum = hum,
+        .value = value,
+        .input_cycles = input_cycles,
+        // The switch edge already is a latency_stamp(), with its low bit forced
+        .origin_cycles = input_cycles != 0 ? input_cycles : latency_stamp(),
+        .result = result,
+    };
+
+    // Only the poster waits when the mailbox is full, the controller never blocks on it
+    k_msgq_put(&room_mailbox, &cmd, K_FOREVER);
 }
 
-void process_light_control(struct Room *room, uint32_t new_light_gpio_value) {
-    if (new_light_gpio_value != room->light_gpio_value) {
-        turn_on_off_light(room, new_light_gpio_value);
+/* Posts a command and blocks until the controller has handled it */
+static int room_post_wait(enum room_command_type type, const struct Room *room, int32_t value) {
+    struct room_result result;
+
+    k_sem_init(&result.done, 0, 1);
+    room_post(type, room, value, 0, 0, &result);
+    k_sem_take(&result.done, K_FOREVER);
+    return result.ret;
+}
+
+void room_apply_batch(struct room_op *ops, size_t count) {
+    struct room_result result;
+    struct room_command cmd = {
+        .type = ROOM_CMD_BATCH,
+        .value = count,
+        .origin_cycles = latency_stamp(),
+        .result = &result,
+        .ops = ops,
+    };
+
+    // The ops stay owned by the caller, so it waits until the controller is done with them
+    k_sem_init(&result.done, 0, 1);
+    k_msgq_put(&room_mailbox, &cmd, K_FOREVER);
+    k_sem_take(&result.done, K_FOREVER);
+}
+
+void process_climate_sample(const struct Room *room, uint32_t temp_scaled_value, uint32_t hum_scaled_value) {
+    room_post(ROOM_CMD_CLIMATE, room, (int16_t)temp_scaled_value, hum_scaled_value, 0, NULL);
+}
+
+int process_heat_relay_control(const struct Room *room, bool turn_on) {
+    return room_post_wait(ROOM_CMD_HEAT_RELAY, room, turn_on);
+}
+
+int process_light_control(const struct Room *room, uint32_t new_light_gpio_value) {
+    return room_post_wait(ROOM_CMD_LIGHT, room, new_light_gpio_value);
+}
+
+void process_light_switch(const struct Room *room, uint32_t new_light_gpio_value, uint32_t press_cycles) {
+    room_post(ROOM_CMD_LIGHT, room, new_light_gpio_value, 0, press_cycles, NULL);
+}
+
+uint32_t room_light_on_value(const struct Room *room) {
+    // A GPIO light only looks at zero/non-zero, a PWM light takes the brightness
+    return room->light_pwm.dev != NULL ? CONFIG_SMARTHOME_LIGHT_ON_BRIGHTNESS : 1;
+}
+
+static void room_controller_thread(void) {
+    struct room_command cmd;
+
+    // Switches the lights restored by room_settings_restore()
+    room_events_flush();
+
+    while (1) {
+        k_msgq_get(&room_mailbox, &cmd, K_FOREVER);
+
+        // Everything already queued is handled before the next publish
+        do {
+            int ret = room_handle_command(&cmd);
+
+            if (cmd.result != NULL) {
+                cmd.result->ret = ret;
+                k_sem_give(&cmd.result->done);
+            }
+        } while (k_msgq_get(&room_mailbox, &cmd, K_NO_WAIT) == 0);
+
+        if (state_dirty) {
+            room_snapshot_publish();
+            state_dirty = false;
+        }
+        room_events_flush();
+    }
+}
+
+void room_settings_restore(const struct Room *room, const struct room_settings *settings) {
+    struct room_state *state = &room_states[room->room_id];
+
+    // The controller isn't running and nobody reads the snapshot yet, both copies are set directly
+    state->desired_temperature = settings->desired_temperature;
+    state->temperature_offset = settings->temperature_offset;
+    if (settings->light_gpio_value != state->light_gpio_value &&
+        register_new_event(room, settings->light_gpio_value, LIGHT_EV, true) != -ENOMEM) {
+        state->light_gpio_value = settings->light_gpio_value;
     }
+    published_states[room->room_id] = *state;
+}
+
+// --- Thread definitions ---
+/* Started by room_controller_start(), once saved settings are restored */
+K_THREAD_DEFINE(room_controller_id, ROOM_CONTROLLER_STACKSIZE, room_controller_thread, NULL, NULL, NULL,
+                ROOM_CONTROLLER_PRIORITY, 0, SYS_FOREVER_MS);
 
+void room_controller_start(void) {
+    k_thread_start(room_controller_id);
 }
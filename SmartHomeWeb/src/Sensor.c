@@ -0,0 +1,305 @@
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/drivers/sensor_data_types.h>
+#include <zephyr/rtio/rtio.h>
+
+#include "Sensor.h"
+
+LOG_MODULE_REGISTER(sensor, LOG_LEVEL_DBG);
+
+/* Sensors read in the RTIO batch: the hs300x parts and their emulation on native_sim */
+#define HS300X_FOREACH(fn)                                                     \
+    DT_FOREACH_STATUS_OKAY(renesas_hs300x, fn)                                 \
+    DT_FOREACH_STATUS_OKAY(smarthome_sim_sensor, fn)
+#define HS300X_COUNT                                                           \
+    (DT_NUM_INST_STATUS_OKAY(renesas_hs300x) + DT_NUM_INST_STATUS_OKAY(smarthome_sim_sensor))
+
+/* One RTIO iodev per hs300x node, reading temperature and humidity */
+#define HS300X_IODEV_NAME(node) _CONCAT(hs300x_iodev_, DT_DEP_ORD(node))
+
+#define HS300X_IODEV_DEFINE_NAMED(name, node)                                  \
+    SENSOR_DT_READ_IODEV(name, node,                                           \
+                         { SENSOR_CHAN_AMBIENT_TEMP, 0 },                      \
+                         { SENSOR_CHAN_HUMIDITY, 0 });
+
+#define HS300X_IODEV_DEFINE(node) HS300X_IODEV_DEFINE_NAMED(HS300X_IODEV_NAME(node), node)
+
+HS300X_FOREACH(HS300X_IODEV_DEFINE)
+
+/* Every sensor can have a read in flight, result buffers come from the context mempool */
+RTIO_DEFINE_WITH_MEMPOOL(hs300x_ctx, HS300X_COUNT, HS300X_COUNT,
+                         HS300X_COUNT * 4, 16, sizeof(void *));
+
+struct hs300x_sensor {
+    const struct device *dev;
+    struct rtio_iodev *iodev;
+    uint32_t submit_cycles;
+    uint32_t temp_scaled;
+    uint32_t hum_scaled;
+    bool valid;
+    struct sensor_read_stats stats;
+};
+
+#define HS300X_ENTRY(node) {                                                   \
+    .dev = DEVICE_DT_GET(node),                                                \
+    .iodev = &HS300X_IODEV_NAME(node),                                         \
+    .stats = { .min_us = UINT32_MAX },                                         \
+},
+
+static struct hs300x_sensor hs300x_sensors[] = {
+    HS300X_FOREACH(HS300X_ENTRY)
+};
+
+K_MUTEX_DEFINE(hs300x_lock);
+
+/* Converts a Q31 reading into a value scaled by 100 (0.01 units) */
+static int32_t q31_to_scaled(q31_t q, int8_t shift) {
+    return (int32_t)(((int64_t)q * 100) >> (31 - shift));
+}
+
+static int decode_channel(const struct sensor_decoder_api *decoder, const uint8_t *buf,
+                          enum sensor_channel channel, int32_t *scaled) {
+    struct sensor_q31_data q_data = {0};
+    uint32_t fit = 0;
+
+    int rc = decoder->decode(buf, (struct sensor_chan_spec){channel, 0}, &fit, 1, &q_data);
+    if (rc <= 0) {
+        return rc < 0 ? rc : -ENODATA;
+    }
+
+    *scaled = q31_to_scaled(q_data.readings[0].value, q_data.shift);
+    return 0;
+}
+
+static void record_latency(struct sensor_read_stats *stats, uint32_t latency_us) {
+    stats->last_us = latency_us;
+    stats->total_us += latency_us;
+    if (latency_us < stats->min_us) {
+        stats->min_us = latency_us;
+    }
+    if (latency_us > stats->max_us) {
+        stats->max_us = latency_us;
+    }
+}
+
+static void handle_completion(struct rtio_cqe *cqe) {
+    struct hs300x_sensor *sensor = cqe->userdata;
+    int result = cqe->result;
+    uint8_t *buf = NULL;
+    uint32_t buf_len = 0;
+
+    int rc = rtio_cqe_get_mempool_buffer(&hs300x_ctx, cqe, &buf, &buf_len);
+    rtio_cqe_release(&hs300x_ctx, cqe);
+
+    uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - sensor->submit_cycles);
+    record_latency(&sensor->stats, latency_us);
+
+    if (result < 0 || rc != 0) {
+        LOG_WRN("Read of %s failed: %d", sensor->dev->name, result < 0 ? result : rc);
+        sensor->stats.errors++;
+        sensor->valid = false;
+        if (rc == 0) {
+            rtio_release_buffer(&hs300x_ctx, buf, buf_len);
+        }
+        return;
+    }
+
+    const struct sensor_decoder_api *decoder;
+    int32_t temp_scaled = 0;
+    int32_t hum_scaled = 0;
+
+    rc = sensor_get_decoder(sensor->dev, &decoder);
+    if (rc == 0) {
+        rc = decode_channel(decoder, buf, SENSOR_CHAN_AMBIENT_TEMP, &temp_scaled);
+    }
+    if (rc == 0) {
+        rc = decode_channel(decoder, buf, SENSOR_CHAN_HUMIDITY, &hum_scaled);
+    }
+    rtio_release_buffer(&hs300x_ctx, buf, buf_len);
+
+    if (rc != 0) {
+        LOG_WRN("Decoding %s failed: %d", sensor->dev->name, rc);
+        sensor->stats.errors++;
+        sensor->valid = false;
+        return;
+    }
+
+    sensor->temp_scaled = temp_scaled;
+    sensor->hum_scaled = hum_scaled;
+    sensor->valid = true;
+    sensor->stats.reads++;
+}
+
+int hs300x_read_all(void) {
+    int submitted = 0;
+
+    if (HS300X_COUNT == 0) {
+        return 0;
+    }
+
+    k_mutex_lock(&hs300x_lock, K_FOREVER);
+
+    /* Queue every read first so the conversions overlap on the bus */
+    for (size_t i = 0; i < ARRAY_SIZE(hs300x_sensors); i++) {
+        struct rtio_sqe *sqe = rtio_sqe_acquire(&hs300x_ctx);
+        if (sqe == NULL) {
+            LOG_ERR("No RTIO submission slot for %s", hs300x_sensors[i].dev->name);
+            break;
+        }
+        rtio_sqe_prep_read_with_pool(sqe, hs300x_sensors[i].iodev, RTIO_PRIO_NORM,
+                                     &hs300x_sensors[i]);
+        hs300x_sensors[i].submit_cycles = k_cycle_get_32();
+        submitted++;
+    }
+
+    rtio_submit(&hs300x_ctx, 0);
+
+    /* Handle completions in whatever order the sensors finish */
+    for (int i = 0; i < submitted; i++) {
+        handle_completion(rtio_cqe_consume_block(&hs300x_ctx));
+    }
+
+    k_mutex_unlock(&hs300x_lock);
+    return submitted == ARRAY_SIZE(hs300x_sensors) ? 0 : -ENOMEM;
+}
+
+int hs300x_get_sample(const struct device *dev, uint32_t *temp_scaled, uint32_t *hum_scaled) {
+    int rc = -ENODEV;
+
+    k_mutex_lock(&hs300x_lock, K_FOREVER);
+    for (size_t i = 0; i < ARRAY_SIZE(hs300x_sensors); i++) {
+        if (hs300x_sensors[i].dev != dev) {
+            continue;
+        }
+        if (!hs300x_sensors[i].valid) {
+            rc = -ENODATA;
+            break;
+        }
+        *temp_scaled = hs300x_sensors[i].temp_scaled;
+        *hum_scaled = hs300x_sensors[i].hum_scaled;
+        rc = 0;
+        break;
+    }
+    k_mutex_unlock(&hs300x_lock);
+    return rc;
+}
+
+size_t hs300x_sensor_count(void) {
+    return ARRAY_SIZE(hs300x_sensors);
+}
+
+const struct device *hs300x_get_stats(size_t idx, struct sensor_read_stats *stats) {
+    if (idx >= ARRAY_SIZE(hs300x_sensors)) {
+        return NULL;
+    }
+
+    k_mutex_lock(&hs300x_lock, K_FOREVER);
+    *stats = hs300x_sensors[idx].stats;
+    k_mutex_unlock(&hs300x_lock);
+    return hs300x_sensors[idx].dev;
+}
+
+int sensor_fetch_scaled(const struct device *dev, uint32_t *temp_scaled, uint32_t *hum_scaled) {
+    int rc = sensor_sample_fetch(dev);
+
+    if (rc != 0) {
+        LOG_WRN("Sensor fetch failed: %d", rc);
+        return rc;
+    }
+
+    struct sensor_value temperature;
+    struct sensor_value humidity;
+
+    rc = sensor_channel_get(dev, SENSOR_CHAN_AMBIENT_TEMP, &temperature);
+    if (rc == 0) {
+        rc = sensor_channel_get(dev, SENSOR_CHAN_HUMIDITY, &humidity);
+    }
+    if (rc != 0) {
+        LOG_WRN("get failed: %d", rc);
+        return rc;
+    }
+    *temp_scaled = (uint32_t)(sensor_value_to_double(&temperature) * 100);
+    *hum_scaled = (uint32_t)(sensor_value_to_double(&humidity) * 100);
+    return 0;
+}
+
+/* Registry of physical sensors keyed by device. The entry lock is held for the
+ * whole hardware fetch, so concurrent requests for the same sensor wait for
+ * that one fetch and then read its result from the cache.
+ */
+struct sensor_cache_entry {
+    const struct device *dev;
+    struct k_mutex lock;
+    int64_t timestamp;                         // Uptime (ms) of the cached sample
+    uint32_t temp_scaled;
+    uint32_t hum_scaled;
+    bool valid;
+    struct sensor_cache_stats stats;
+};
+
+static struct sensor_cache_entry sensor_cache[CONFIG_SMARTHOME_SENSOR_CACHE_SIZE];
+K_MUTEX_DEFINE(sensor_cache_lock);
+
+static struct sensor_cache_entry *sensor_cache_lookup(const struct device *dev) {
+    struct sensor_cache_entry *entry = NULL;
+
+    k_mutex_lock(&sensor_cache_lock, K_FOREVER);
+    for (size_t i = 0; i < ARRAY_SIZE(sensor_cache); i++) {
+        if (sensor_cache[i].dev == dev) {
+            entry = &sensor_cache[i];
+            break;
+        }
+        if (sensor_cache[i].dev == NULL) {
+            entry = &sensor_cache[i];
+            k_mutex_init(&entry->lock);
+            entry->dev = dev;
+            break;
+        }
+    }
+    k_mutex_unlock(&sensor_cache_lock);
+    return entry;
+}
+
+int sensor_cache_read(const struct device *dev, sensor_fetch_fn fetch,
+                      uint32_t *temp_scaled, uint32_t *hum_scaled) {
+    struct sensor_cache_entry *entry = sensor_cache_lookup(dev);
+    int rc = 0;
+
+    if (entry == NULL) {
+        LOG_WRN("Sensor cache full, reading %s uncached", dev->name);
+        return fetch(dev, temp_scaled, hum_scaled);
+    }
+
+    k_mutex_lock(&entry->lock, K_FOREVER);
+    if (entry->valid && k_uptime_get() - entry->timestamp < CONFIG_SMARTHOME_SENSOR_CACHE_TTL_MS) {
+        entry->stats.hits++;
+    } else {
+        entry->stats.misses++;
+        rc = fetch(dev, &entry->temp_scaled, &entry->hum_scaled);
+        entry->valid = rc == 0;
+        entry->timestamp = k_uptime_get();
+        if (rc != 0) {
+            entry->stats.errors++;
+        }
+    }
+
+    if (rc == 0) {
+        *temp_scaled = entry->temp_scaled;
+        *hum_scaled = entry->hum_scaled;
+    }
+    k_mutex_unlock(&entry->lock);
+    return rc;
+}
+
+const struct device *sensor_cache_get_stats(size_t idx, struct sensor_cache_stats *stats) {
+    if (idx >= ARRAY_SIZE(sensor_cache) || sensor_cache[idx].dev == NULL) {
+        return NULL;
+    }
+
+    k_mutex_lock(&sensor_cache[idx].lock, K_FOREVER);
+    *stats = sensor_cache[idx].stats;
+    k_mutex_unlock(&sensor_cache[idx].lock);
+    return sensor_cache[idx].dev;
+}
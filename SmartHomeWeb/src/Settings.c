@@ -0,0 +1,165 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/atomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Room.h"
+#include "Settings.h"
+
+LOG_MODULE_REGISTER(room_settings, LOG_LEVEL_INF);
+
+/* Every room is one record under "smarthome/room/<id>" holding a struct room_settings */
+#define ROOM_SETTINGS_ROOT "smarthome"
+#define ROOM_SETTINGS_KEY_LEN sizeof(ROOM_SETTINGS_ROOT "/room/255")
+
+BUILD_ASSERT(sizeof(struct room_settings) == 6, "struct room_settings is the stored record, keep it packed");
+
+/* Records read by settings_load_subtree(), only used during room_settings_load() */
+static struct room_settings loaded[ROOM_COUNT];
+static ATOMIC_DEFINE(loaded_rooms, ROOM_COUNT);
+
+/* What flash holds for every room, only touched by the save work after boot */
+static struct room_settings saved[ROOM_COUNT];
+
+/* Values reported by room_settings_changed() and the rooms changed since the last save */
+static struct room_settings changed[ROOM_COUNT];
+static ATOMIC_DEFINE(dirty_rooms, ROOM_COUNT);
+static struct k_spinlock changed_lock;
+
+static atomic_t restored_count;
+static atomic_t change_count;
+static atomic_t write_count;
+static atomic_t write_bytes;
+static atomic_t unchanged_count;
+static atomic_t write_error_count;
+
+static void room_settings_save(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(room_settings_work, room_settings_save);
+
+static void room_settings_from_state(const struct room_state *state, struct room_settings *settings) {
+    *settings = (struct room_settings){
+        .desired_temperature = state->desired_temperature,
+        .temperature_offset = state->temperature_offset,
+        .light_gpio_value = state->light_gpio_value,
+    };
+}
+
+static int room_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (!settings_name_steq(name, "room", &next) || next == NULL) {
+        return -ENOENT;
+    }
+
+    char *end;
+    long id = strtol(next, &end, 10);
+    if (end == next || *end != '\0' || id < 0 || id >= ROOM_COUNT) {
+        LOG_WRN("Ignoring saved settings %s", name);
+        return 0;
+    }
+
+    // Records of another layout are dropped, the room keeps its devicetree defaults
+    if (len != sizeof(struct room_settings)) {
+        LOG_WRN("Saved settings of room %ld have %zu bytes, expected %zu", id, len,
+                sizeof(struct room_settings));
+        return 0;
+    }
+
+    ssize_t rc = read_cb(cb_arg, &loaded[id], sizeof(loaded[id]));
+    if (rc != sizeof(loaded[id])) {
+        LOG_ERR("Reading saved settings of room %ld failed: %d", id, (int)rc);
+        return rc < 0 ? rc : -EIO;
+    }
+
+    atomic_set_bit(loaded_rooms, id);
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(smarthome, ROOM_SETTINGS_ROOT, NULL, room_settings_set, NULL, NULL);
+
+int room_settings_load(void) {
+    int rc = settings_subsys_init();
+    if (rc == 0) {
+        rc = settings_load_subtree(ROOM_SETTINGS_ROOT);
+    }
+    if (rc != 0) {
+        LOG_ERR("Loading saved settings failed: %d, rooms start with their defaults", rc);
+    }
+
+    for (int id = 0; id < ROOM_COUNT; id++) {
+        struct room_state state;
+        room_state_get(id, &state);
+
+        if (!atomic_test_bit(loaded_rooms, id)) {
+            room_settings_from_state(&state, &saved[id]);
+            continue;
+        }
+
+        saved[id] = loaded[id];
+        room_settings_restore(get_room_by_id(id), &saved[id]);
+        atomic_inc(&restored_count);
+        LOG_INF("Room %d restored: setpoint %d, hysteresis %u, light %u", id,
+                saved[id].desired_temperature, saved[id].temperature_offset, saved[id].light_gpio_value);
+    }
+    return rc;
+}
+
+void room_settings_changed(uint8_t room_id, const struct room_state *state) {
+    k_spinlock_key_t key = k_spin_lock(&changed_lock);
+
+    room_settings_from_state(state, &changed[room_id]);
+    atomic_set_bit(dirty_rooms, room_id);
+    k_spin_unlock(&changed_lock, key);
+
+    atomic_inc(&change_count);
+    // Not rescheduled: the first change starts the delay, so a steady stream of changes still gets saved
+    k_work_schedule(&room_settings_work, K_MSEC(CONFIG_SMARTHOME_SETTINGS_SAVE_DELAY_MS));
+}
+
+/* Writes the last reported settings of every dirty room that differs from flash */
+static void room_settings_save(struct k_work *work) {
+    char key[ROOM_SETTINGS_KEY_LEN];
+
+    for (int id = 0; id < ROOM_COUNT; id++) {
+        struct room_settings settings;
+        k_spinlock_key_t lock_key = k_spin_lock(&changed_lock);
+        bool dirty = atomic_test_and_clear_bit(dirty_rooms, id);
+
+        // Taken together with the bit, so a change reported meanwhile is saved by the next run
+        settings = changed[id];
+        k_spin_unlock(&changed_lock, lock_key);
+        if (!dirty) {
+            continue;
+        }
+
+        if (memcmp(&settings, &saved[id], sizeof(settings)) == 0) {
+            atomic_inc(&unchanged_count);
+            continue;
+        }
+
+        snprintk(key, sizeof(key), ROOM_SETTINGS_ROOT "/room/%d", id);
+        int rc = settings_save_one(key, &settings, sizeof(settings));
+        if (rc != 0) {
+            LOG_ERR("Saving settings of room %d failed: %d", id, rc);
+            atomic_inc(&write_error_count);
+            atomic_set_bit(dirty_rooms, id);
+            k_work_schedule(&room_settings_work, K_MSEC(CONFIG_SMARTHOME_SETTINGS_SAVE_DELAY_MS));
+            continue;
+        }
+
+        saved[id] = settings;
+        atomic_inc(&write_count);
+        atomic_add(&write_bytes, sizeof(settings));
+    }
+}
+
+void get_room_settings_stats(struct room_settings_stats *stats) {
+    stats->restored = atomic_get(&restored_count);
+    stats->changes = atomic_get(&change_count);
+    stats->writes = atomic_get(&write_count);
+    stats->write_bytes = atomic_get(&write_bytes);
+    stats->unchanged = atomic_get(&unchanged_count);
+    stats->write_errors = atomic_get(&write_error_count);
+}
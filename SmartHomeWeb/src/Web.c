@@ -6,9 +6,20 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/net/websocket.h>
+#include <zephyr/net/socket.h>
 #include <zephyr/sys/time_units.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/barrier.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <zephyr/posix/sys/eventfd.h>
 
 #include "Room.h"
+#include "Web.h"
+#include "WsEncode.h"
+#include "History.h"
+#include "Metrics.h"
 
 #define MAX_ROOMS 5
 
@@ -29,63 +40,41 @@ static const struct json_obj_descr led_command_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct led_command, led_val, JSON_TOK_TRUE),
 };
 
-struct room_light_command {
+/* POST body of a light, either light_value (on/off) or brightness (percent) is given */
+struct room_light_post {
 	int room_id;
 	int light_value;
+	int brightness;
 };
-static const struct json_obj_descr room_light_command_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct room_light_command, room_id, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct room_light_command, light_value, JSON_TOK_NUMBER),
+static const struct json_obj_descr room_light_post_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct room_light_post, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_light_post, light_value, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_light_post, brightness, JSON_TOK_NUMBER),
 };
 
-// JSON commands for temperature and humidity only for reading
-struct room_temp_read_command {
-	int room_id;
-	int temp_value;
-	int hum_value;
-};
-
-static const struct json_obj_descr room_temp_command_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, room_id, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, temp_value, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, hum_value, JSON_TOK_NUMBER),
-};
-
-// JSON commands for temperature setting
-struct room_temp_set_command {
+/* POST body of a room's heating, setpoint_temp_value and/or temperature_offset (hysteresis) is given */
+struct room_temp_post {
 	int room_id;
 	int setpoint_temp_value;
+	int temperature_offset;
 };
-static const struct json_obj_descr room_temp_set_command_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct room_temp_set_command, room_id, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct room_temp_set_command, setpoint_temp_value, JSON_TOK_NUMBER),
-};
-
-struct room_temp_heat_relay_command {
-	int room_id;
-	bool heat_relay_state;
-};
-
-static const struct json_obj_descr room_temp_heat_relay_command_descr[] = {
-	JSON_OBJ_DESCR_PRIM(struct room_temp_heat_relay_command, room_id, JSON_TOK_NUMBER),
-	JSON_OBJ_DESCR_PRIM(struct room_temp_heat_relay_command, heat_relay_state, JSON_TOK_TRUE),
+static const struct json_obj_descr room_temp_post_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct room_temp_post, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_post, setpoint_temp_value, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_post, temperature_offset, JSON_TOK_NUMBER),
 };
 
 struct RoomData {
     uint32_t room_id;
     const char* room_name;
-    uint32_t temp_sensor_value;
+    int32_t temp_sensor_value;
     uint32_t hum_sensor_value;
     uint32_t light_gpio_value;
-    uint32_t desired_temperature;
+    int32_t desired_temperature;
+    uint32_t temperature_offset;
     bool heat_relay_state;
 };
 
-struct RoomCollection {
-    struct RoomData rooms[STRUCT_ROOM_COUNT];
-    size_t num_rooms;
-};
-
 static const struct json_obj_descr room_command_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct RoomData, room_id, JSON_TOK_NUMBER),
 	JSON_OBJ_DESCR_PRIM(struct RoomData, room_name, JSON_TOK_STRING),
@@ -93,13 +82,10 @@ static const struct json_obj_descr room_command_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct RoomData, hum_sensor_value, JSON_TOK_NUMBER),
 	JSON_OBJ_DESCR_PRIM(struct RoomData, light_gpio_value, JSON_TOK_NUMBER),
 	JSON_OBJ_DESCR_PRIM(struct RoomData, desired_temperature, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct RoomData, temperature_offset, JSON_TOK_NUMBER),
 	JSON_OBJ_DESCR_PRIM(struct RoomData, heat_relay_state, JSON_TOK_TRUE),
 
 };
-static const struct json_obj_descr room_array_descr[] = {
-    JSON_OBJ_DESCR_OBJ_ARRAY(struct RoomCollection, rooms, STRUCT_ROOM_COUNT, 
-                             num_rooms, room_command_descr, ARRAY_SIZE(room_command_descr)),
-};
 
 /* End JOSN conf */
 
@@ -113,16 +99,73 @@ static void http_response(struct http_response_ctx *response_ctx, uint16_t statu
 	response_ctx->final_chunk = final_chunk;
 }
 
-/* Polymorphic function pointer for POST parser functions */
-typedef bool (*post_parser_fn)(uint8_t *buf, size_t len);
+/* Buffer a POST parser may write a response body into, len stays 0 for no body */
+struct post_reply {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+/* Result of a light or relay command whose actuator event could not be allocated,
+ * the room state is left unchanged
+ */
+#define EVENT_POOL_FULL_RESULT "event pool full"
+
+/* Polymorphic function pointer for POST parser functions. Parsers are called from the
+ * HTTP server thread and from ws_rx_thread for WebSocket commands, so they may run
+ * concurrently and must lock any state they share, as batch_ops_lock does.
+ */
+typedef bool (*post_parser_fn)(uint8_t *buf, size_t len, struct post_reply *reply);
 struct post_state {
-	uint8_t *buf;
-	size_t cursor;
 	uint16_t max_size;
 	post_parser_fn parser;
 };
 
-static bool parse_led_post(uint8_t *buf, size_t len)
+/* Request bodies are collected in a fixed pool with one slot per HTTP client, so
+ * concurrent POSTs never share a buffer and never touch the heap. The slots need no
+ * locking because only post_handler() uses them, on the HTTP server thread. The
+ * WebSocket path has its own ws_rx_* buffers and must not use these slots.
+ */
+struct post_body {
+	struct http_client_ctx *client;            // NULL when the slot is free
+	size_t cursor;                             // Bytes received so far
+	bool overflow;                             // Body exceeded the resource max_size
+	uint8_t buf[CONFIG_SMARTHOME_POST_BODY_SIZE + 1];
+};
+
+static struct post_body post_bodies[CONFIG_HTTP_SERVER_MAX_CLIENTS];
+
+static struct post_body *post_body_get(struct http_client_ctx *client, bool open)
+{
+	struct post_body *free_slot = NULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(post_bodies); i++) {
+		if (post_bodies[i].client == client) {
+			return &post_bodies[i];
+		}
+		if (post_bodies[i].client == NULL && free_slot == NULL) {
+			free_slot = &post_bodies[i];
+		}
+	}
+
+	if (open && free_slot != NULL) {
+		free_slot->client = client;
+		free_slot->cursor = 0;
+		free_slot->overflow = false;
+		return free_slot;
+	}
+	return NULL;
+}
+
+static void post_body_release(struct post_body *body)
+{
+	if (body != NULL) {
+		body->client = NULL;
+		body->cursor = 0;
+	}
+}
+
+static bool parse_led_post(uint8_t *buf, size_t len, struct post_reply *reply)
 {
 	int ret;
 	struct led_command cmd;
@@ -138,173 +181,672 @@ static bool parse_led_post(uint8_t *buf, size_t len)
 	LOG_INF("POST request setting LED %d to state %d", cmd.led_num, cmd.led_val);
 
     const struct gpio_dt_spec *gpio = get_led_by_id(cmd.led_num);
+    if (gpio == NULL) {
+        LOG_WRN("Unknown LED %d", cmd.led_num);
+        return false;
+    }
 
     gpio_pin_set(gpio->port, gpio->pin, cmd.led_val);
 	return true;
 }
 
-static bool parse_room_light_post(uint8_t *buf, size_t len)
+static bool parse_room_light_post(uint8_t *buf, size_t len, struct post_reply *reply)
 {
 	int ret;
-	struct room_light_command cmd;
-	const int expected_return_code = BIT_MASK(ARRAY_SIZE(room_light_command_descr));
+	struct room_light_post cmd;
 
 	buf[len] = '\0';
-	ret = json_obj_parse(buf, len, room_light_command_descr, ARRAY_SIZE(room_light_command_descr), &cmd);
-	if (ret != expected_return_code) {
+	ret = json_obj_parse(buf, len, room_light_post_descr, ARRAY_SIZE(room_light_post_descr), &cmd);
+	if (ret < 0 || !(ret & BIT(0)) || !(ret & (BIT(1) | BIT(2)))) {
 		LOG_WRN("Failed to fully parse JSON payload, ret=%d", ret);
 		return false;
 	}
 
-	LOG_INF("POST request setting LIGHT %d to state %d", cmd.room_id, cmd.light_value);
+    const struct Room *room = get_room_by_id(cmd.room_id);
+    if (room == NULL) {
+        LOG_WRN("Unknown room %d", cmd.room_id);
+        return false;
+    }
+
+    uint32_t new_state;
+    if (ret & BIT(2)) {
+        if (cmd.brightness < 0 || cmd.brightness > 100) {
+            LOG_WRN("Brightness %d out of range", cmd.brightness);
+            return false;
+        }
+        // A GPIO light has no brightness, anything above 0 is on
+        new_state = room->light_pwm.dev != NULL ? cmd.brightness : cmd.brightness > 0;
+    } else {
+        new_state = cmd.light_value ? room_light_on_value(room) : 0;
+    }
 
-    struct Room *room = get_room_by_id(cmd.room_id);
-    uint32_t new_state = cmd.light_value ? room->light_pwm->period * 90 /100 : 0;
-	process_light_control(room, new_state);
+	LOG_INF("POST request setting LIGHT %d to state %d", cmd.room_id, new_state);
+	if (process_light_control(room, new_state) < 0) {
+		reply->len = snprintk(reply->buf, reply->size, "{\"result\":\"" EVENT_POOL_FULL_RESULT "\"}");
+		return false;
+	}
 	return true;
 }
 
-static bool parse_temp_post(uint8_t *buf, size_t len)
+static bool parse_temp_post(uint8_t *buf, size_t len, struct post_reply *reply)
 {
 	int ret;
-	struct room_temp_set_command cmd;
-	const int expected_return_code = BIT_MASK(ARRAY_SIZE(room_temp_set_command_descr));
+	struct room_temp_post cmd;
 
 	buf[len] = '\0';
-	ret = json_obj_parse(buf, len, room_temp_set_command_descr, ARRAY_SIZE(room_temp_set_command_descr), &cmd);
-	if (ret != expected_return_code) {
+	ret = json_obj_parse(buf, len, room_temp_post_descr, ARRAY_SIZE(room_temp_post_descr), &cmd);
+	if (ret < 0 || !(ret & BIT(0)) || !(ret & (BIT(1) | BIT(2)))) {
 		LOG_WRN("Failed to fully parse JSON payload, ret=%d", ret);
 		return false;
 	}
 
-	LOG_INF("POST request received ROOM %d SETPOINTvalue %d", cmd.room_id, cmd.setpoint_temp_value);
+	if ((ret & BIT(1)) && (cmd.setpoint_temp_value < INT16_MIN || cmd.setpoint_temp_value > INT16_MAX)) {
+		LOG_WRN("Setpoint %d out of range", cmd.setpoint_temp_value);
+		return false;
+	}
+	// Up to 10 C either side of the setpoint
+	if ((ret & BIT(2)) && (cmd.temperature_offset < 0 || cmd.temperature_offset > 1000)) {
+		LOG_WRN("Temperature offset %d out of range", cmd.temperature_offset);
+		return false;
+	}
 
-	struct Room *room = get_room_by_id(cmd.room_id);
-	if (room != NULL) {
-		register_new_event(room, cmd.setpoint_temp_value, SETPOINT_EV, true);
-		room->desired_temperature = cmd.setpoint_temp_value;
-		// After setting new desired temperature, process control logic
-		process_temperature_control(room);
-		return true;
+	const struct Room *room = get_room_by_id(cmd.room_id);
+	if (room == NULL) {
+		return false;
 	}
-	return false;
+
+	// Both changes are published, and pushed to the web clients, together
+	struct room_op ops[2];
+	size_t count = 0;
+	if (ret & BIT(2)) {
+		LOG_INF("POST request received ROOM %d OFFSET %d", cmd.room_id, cmd.temperature_offset);
+		ops[count++] = (struct room_op){ room, ROOM_OP_HYSTERESIS, cmd.temperature_offset };
+	}
+	if (ret & BIT(1)) {
+		LOG_INF("POST request received ROOM %d SETPOINTvalue %d", cmd.room_id, cmd.setpoint_temp_value);
+		ops[count++] = (struct room_op){ room, ROOM_OP_SETPOINT, cmd.setpoint_temp_value };
+	}
+	room_apply_batch(ops, count);
+	return true;
 }
 
-static struct post_state led_post_state = {
-	.buf = NULL,
-	.cursor = 0,
+/* A batch is a JSON array of commands, each one a room_id and exactly one of
+ * light_value, brightness, setpoint_temp_value or heat_relay_state. The whole
+ * array is validated before anything is applied.
+ */
+struct batch_command {
+	int room_id;
+	int light_value;
+	int brightness;
+	int setpoint_temp_value;
+	bool heat_relay_state;
+};
+static const struct json_obj_descr batch_command_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct batch_command, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct batch_command, light_value, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct batch_command, brightness, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct batch_command, setpoint_temp_value, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct batch_command, heat_relay_state, JSON_TOK_TRUE),
+};
+
+/* Batches arrive over HTTP and over the WebSocket, the scratch ops are shared */
+static struct room_op batch_ops[CONFIG_SMARTHOME_BATCH_MAX_COMMANDS];
+static const char *batch_results[CONFIG_SMARTHOME_BATCH_MAX_COMMANDS];
+K_MUTEX_DEFINE(batch_ops_lock);
+
+/* Checks one parsed command, returns NULL when valid or the reason it is not */
+static const char *batch_validate(const struct batch_command *cmd, int fields, struct room_op *op)
+{
+	int actions = fields & ~BIT(0);
+
+	if (!(fields & BIT(0)) || actions == 0 || (actions & (actions - 1)) != 0) {
+		return "bad command";
+	}
+
+	op->room = get_room_by_id(cmd->room_id);
+	if (op->room == NULL) {
+		return "unknown room";
+	}
+
+	if (fields & BIT(1)) {
+		op->type = ROOM_OP_LIGHT;
+		op->value = cmd->light_value ? room_light_on_value(op->room) : 0;
+	} else if (fields & BIT(2)) {
+		if (cmd->brightness < 0 || cmd->brightness > 100) {
+			return "out of range";
+		}
+		op->type = ROOM_OP_LIGHT;
+		op->value = op->room->light_pwm.dev != NULL ? cmd->brightness : cmd->brightness > 0;
+	} else if (fields & BIT(3)) {
+		if (cmd->setpoint_temp_value < INT16_MIN || cmd->setpoint_temp_value > INT16_MAX) {
+			return "out of range";
+		}
+		op->type = ROOM_OP_SETPOINT;
+		op->value = cmd->setpoint_temp_value;
+	} else {
+		if (op->room->heat_relay.port == NULL) {
+			return "no heat relay";
+		}
+		op->type = ROOM_OP_HEAT_RELAY;
+		op->value = cmd->heat_relay_state;
+	}
+	return NULL;
+}
+
+/* Writes {"applied":..,"results":[..]} into the reply, leaves it empty if it doesn't fit */
+static void batch_format_results(struct post_reply *reply, bool applied, size_t count)
+{
+	size_t pos = 0;
+
+#define BATCH_APPEND(...)                                                              \
+	do {                                                                           \
+		if (pos < reply->size) {                                               \
+			int n = snprintk(reply->buf + pos, reply->size - pos, __VA_ARGS__); \
+			pos += MAX(n, 0);                                              \
+		}                                                                      \
+	} while (0)
+
+	BATCH_APPEND("{\"applied\":%s,\"results\":[", applied ? "true" : "false");
+	for (size_t i = 0; i < count; i++) {
+		BATCH_APPEND("%s\"%s\"", i ? "," : "", batch_results[i]);
+	}
+	BATCH_APPEND("]}");
+
+#undef BATCH_APPEND
+
+	if (pos >= reply->size) {
+		LOG_WRN("Batch results don't fit in %zu bytes", reply->size);
+		pos = 0;
+	}
+	reply->len = pos;
+}
+
+static bool parse_batch_post(uint8_t *buf, size_t len, struct post_reply *reply)
+{
+	struct json_obj json;
+	struct batch_command cmd;
+	size_t count = 0;
+	bool valid = true;
+	int ret;
+
+	k_mutex_lock(&batch_ops_lock, K_FOREVER);
+
+	buf[len] = '\0';
+	ret = json_arr_separate_object_parse_init(&json, (char *)buf, len);
+	while (ret == 0) {
+		ret = json_arr_separate_parse_object(&json, batch_command_descr,
+						     ARRAY_SIZE(batch_command_descr), &cmd);
+		if (ret <= 0) {
+			break;
+		}
+		if (count == ARRAY_SIZE(batch_ops)) {
+			LOG_WRN("Batch has more than %d commands", CONFIG_SMARTHOME_BATCH_MAX_COMMANDS);
+			ret = -E2BIG;
+			break;
+		}
+
+		batch_results[count] = batch_validate(&cmd, ret, &batch_ops[count]);
+		valid &= batch_results[count] == NULL;
+		count++;
+		ret = 0;
+	}
+	if (ret < 0) {
+		k_mutex_unlock(&batch_ops_lock);
+		LOG_WRN("Failed to parse batch payload, ret=%d", ret);
+		return false;
+	}
+
+	// Nothing is applied unless every command is valid
+	bool applied = valid;
+	if (valid) {
+		room_apply_batch(batch_ops, count);
+		for (size_t i = 0; i < count; i++) {
+			batch_results[i] = batch_ops[i].result < 0 ? EVENT_POOL_FULL_RESULT : "ok";
+			applied &= batch_ops[i].result == 0;
+		}
+	}
+
+	LOG_INF("POST batch of %zu commands %s", count,
+		!valid ? "rejected" : applied ? "applied" : "partly applied");
+
+	batch_format_results(reply, valid, count);
+	k_mutex_unlock(&batch_ops_lock);
+	return applied;
+}
+
+static const struct post_state led_post_state = {
 	.max_size = 64,
 	.parser = parse_led_post,
 };
 
-static struct post_state room_light_post_state = {
-	.buf = NULL,
-	.cursor = 0,
+static const struct post_state room_light_post_state = {
 	.max_size = 64,
 	.parser = parse_room_light_post,
 };
 
-static struct post_state room_temp_post_state = {
-	.buf = NULL,
-	.cursor = 0,
+static const struct post_state room_temp_post_state = {
 	.max_size = 128,
 	.parser = parse_temp_post,
 };
 
+static const struct post_state batch_post_state = {
+	.max_size = CONFIG_SMARTHOME_POST_BODY_SIZE,
+	.parser = parse_batch_post,
+};
+
 
 static int post_handler(struct http_client_ctx *client, enum http_data_status status,
 		       const struct http_request_ctx *request_ctx,
 		       struct http_response_ctx *response_ctx, void *user_data)
 {
 
-	struct post_state *state = user_data;
+	const struct post_state *state = user_data;
+	struct post_body *body = post_body_get(client, status != HTTP_SERVER_DATA_ABORTED);
+	size_t max_size = MIN(state->max_size, CONFIG_SMARTHOME_POST_BODY_SIZE);
 
 	LOG_DBG("POST handler status %d, size %zu", status, request_ctx->data_len);
 
 	if (status == HTTP_SERVER_DATA_ABORTED) {
-		if (state->buf) {
-			k_free(state->buf);
-			state->buf = NULL;
-		}
-		state->cursor = 0;
+		post_body_release(body);
 		return 0;
 	}
 
-	if (state->buf == NULL) {
-        state->buf = (uint8_t *)k_malloc(state->max_size + 1);
-        if (!state->buf) {
-            LOG_ERR("Out of memory for POST buffer");
-            return -ENOMEM;
-        }
-        state->cursor = 0;
-    }
-
-	if (request_ctx->data_len + state->cursor > state->max_size) {
-		state->cursor = 0;
-		LOG_ERR("Size of the message is to long, please increase the buffer size");
-		k_free(state->buf);
+	if (body == NULL) {
+		LOG_ERR("No POST buffer left for this client");
 		return -ENOMEM;
 	}
 
-	/* Copy payload to our buffer. Note that even for a small payload, it may arrive split into
-	 * chunks (e.g. if the header size was such that the whole HTTP request exceeds the size of
-	 * the client buffer).
-	 */
-	memcpy(state->buf + state->cursor, request_ctx->data, request_ctx->data_len);
-	state->cursor += request_ctx->data_len;
+	if (request_ctx->data_len + body->cursor > max_size) {
+		// Keep the slot until the final chunk so the rest of the body is dropped too
+		if (!body->overflow) {
+			LOG_ERR("Size of the message is to long, please increase the buffer size");
+		}
+		body->overflow = true;
+	} else {
+		/* Copy payload to our buffer. Note that even for a small payload, it may arrive split into
+		 * chunks (e.g. if the header size was such that the whole HTTP request exceeds the size of
+		 * the client buffer).
+		 */
+		memcpy(body->buf + body->cursor, request_ctx->data, request_ctx->data_len);
+		body->cursor += request_ctx->data_len;
+	}
 
 	if (status == HTTP_SERVER_DATA_FINAL) {
-		if (state->parser(state->buf, state->cursor)) {
-			http_response(response_ctx, 200, NULL, 0, true);
+		/* The parsed body is not needed anymore, the reply reuses its buffer. It is
+		 * sent right after this callback returns, before any other client runs.
+		 */
+		struct post_reply reply = { .buf = (char *)body->buf, .size = sizeof(body->buf) };
+
+		if (body->overflow) {
+			http_response(response_ctx, 413, NULL, 0, true);
+		} else if (state->parser(body->buf, body->cursor, &reply)) {
+			http_response(response_ctx, 200, reply.len ? reply.buf : NULL, reply.len, true);
 		} else {
-			http_response(response_ctx, 400, NULL, 0, true);
+			http_response(response_ctx, 400, reply.len ? reply.buf : NULL, reply.len, true);
 		}
-		k_free(state->buf);
-		state->buf = NULL;
-		state->cursor = 0;
+		post_body_release(body);
 	}
 
 	return 0;
 }
 /* End Poly. POST */
 
+/* Rooms listing is streamed one room per chunk, so a request only ever holds a single
+ * encoded record no matter how many rooms exist.
+ */
+struct rooms_stream {
+	struct http_client_ctx *client;            // NULL when the slot is free
+	size_t next;                               // Index of the next room to send
+	struct room_state states[ROOM_COUNT];      // Snapshot taken when the request started
+	char record[CONFIG_SMARTHOME_ROOM_RECORD_SIZE];
+};
+
+static struct rooms_stream rooms_streams[CONFIG_HTTP_SERVER_MAX_CLIENTS];
+
+HTTP_SERVER_REGISTER_HEADER_CAPTURE(if_none_match_header, "If-None-Match");
+
+static void format_etag(char *buf, size_t len, uint32_t version)
+{
+	snprintk(buf, len, "\"%08x\"", version);
+}
+
+static struct rooms_stream *rooms_stream_get(struct http_client_ctx *client, bool open)
+{
+	struct rooms_stream *free_slot = NULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(rooms_streams); i++) {
+		if (rooms_streams[i].client == client) {
+			return &rooms_streams[i];
+		}
+		if (rooms_streams[i].client == NULL && free_slot == NULL) {
+			free_slot = &rooms_streams[i];
+		}
+	}
+
+	if (open && free_slot != NULL) {
+		free_slot->client = client;
+		free_slot->next = 0;
+		return free_slot;
+	}
+	return NULL;
+}
+
+/* Encodes room idx with its array punctuation: "[{..}", ",{..}" and a closing "]" on the last */
+static int rooms_encode_record(struct rooms_stream *stream, size_t idx)
+{
+	const struct Room *room = get_room_by_id(idx);
+	const struct room_state *state = &stream->states[idx];
+	struct RoomData data = {
+		.room_id = room->room_id,
+		.room_name = room->room_name,
+		.temp_sensor_value = state->temp_sensor_value,
+		.hum_sensor_value = state->hum_sensor_value,
+		.light_gpio_value = state->light_gpio_value,
+		.desired_temperature = state->desired_temperature,
+		.temperature_offset = state->temperature_offset,
+		.heat_relay_state = state->heat_relay_state,
+	};
+
+	stream->record[0] = idx == 0 ? '[' : ',';
+	int ret = json_obj_encode_buf(room_command_descr, ARRAY_SIZE(room_command_descr), &data,
+				      stream->record + 1, sizeof(stream->record) - 2);
+	if (ret < 0) {
+		return ret;
+	}
+
+	size_t len = 1 + strlen(stream->record + 1);
+	if (idx == ROOM_COUNT - 1) {
+		stream->record[len++] = ']';
+	}
+	return len;
+}
+
+static bool etag_matches(const struct http_request_ctx *request_ctx, const char *etag)
+{
+	if (request_ctx->headers_status != HTTP_HEADER_STATUS_OK) {
+		return false;
+	}
+
+	for (size_t i = 0; i < request_ctx->header_count; i++) {
+		if (strcasecmp(request_ctx->headers[i].name, "If-None-Match") == 0 &&
+		    strstr(request_ctx->headers[i].value, etag) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /* Handler for GET */
 static int rooms_get_handler(struct http_client_ctx *client, enum http_data_status status,
 		       const struct http_request_ctx *request_ctx,
 		       struct http_response_ctx *response_ctx, void *user_data)
 {
-	if (status == HTTP_SERVER_DATA_FINAL) {
-		static char json_buf[512];
-
-		struct Room **hardware_rooms = get_all_rooms();
-		struct RoomCollection collection;
-		collection.num_rooms = STRUCT_ROOM_COUNT;
-		for (size_t i = 0; i < STRUCT_ROOM_COUNT; i++) {
-			collection.rooms[i].room_id = hardware_rooms[i]->room_id;
-			collection.rooms[i].room_name = hardware_rooms[i]->room_name;
-			collection.rooms[i].temp_sensor_value = hardware_rooms[i]->temp_sensor_value;
-			collection.rooms[i].hum_sensor_value = hardware_rooms[i]->hum_sensor_value;
-			collection.rooms[i].light_gpio_value = hardware_rooms[i]->light_gpio_value;
-			collection.rooms[i].desired_temperature = hardware_rooms[i]->desired_temperature;
-			collection.rooms[i].heat_relay_state = hardware_rooms[i]->heat_relay_state;
-		}
-		
-		int ret = json_arr_encode_buf(
-			room_array_descr,
-			&collection,
-			json_buf,
-			sizeof(json_buf)
-		);
+	static char etag[12];
+	static struct http_header etag_header = { .name = "ETag", .value = etag };
+	struct rooms_stream *stream = rooms_stream_get(client, false);
+
+	if (status == HTTP_SERVER_DATA_ABORTED) {
+		if (stream != NULL) {
+			stream->client = NULL;
+		}
+		return 0;
+	}
+
+	if (status != HTTP_SERVER_DATA_FINAL) {
+		return 0;
+	}
+
+	if (stream == NULL) {
+		/* Answer a matching If-None-Match straight from the version, no encoding needed */
+		format_etag(etag, sizeof(etag), room_state_version());
+		if (etag_matches(request_ctx, etag)) {
+			http_response(response_ctx, 304, NULL, 0, true);
+			response_ctx->headers = &etag_header;
+			response_ctx->header_count = 1;
+			return 0;
+		}
+
+		stream = rooms_stream_get(client, true);
+		if (stream == NULL) {
+			http_response(response_ctx, 503, NULL, 0, true);
+			return 0;
+		}
+		/* Every chunk comes from this one snapshot, so the body matches its ETag */
+		format_etag(etag, sizeof(etag), room_snapshot_read(stream->states));
+		response_ctx->headers = &etag_header;
+		response_ctx->header_count = 1;
+	}
+
+	int ret = rooms_encode_record(stream, stream->next);
+	if (ret < 0) {
+		LOG_ERR("Failed to encode room %zu: %d", stream->next, ret);
+		stream->client = NULL;
+		return ret;
+	}
+
+	stream->next++;
+	bool final = stream->next == ROOM_COUNT;
+	if (final) {
+		stream->client = NULL;
+	}
+
+	http_response(response_ctx, 200, stream->record, ret, final);
+	return 0;
+}
+
+/* History streaming, one cursor per HTTP client so the data never has to fit in one buffer.
+ * Body: {"now":<uptime s>,"res":"<res>","points":[...]} where a raw point is [t,temp,hum]
+ * and a bucket is [t,temp_min,temp_avg,temp_max,hum_min,hum_avg,hum_max]. The points are
+ * the ones stored when the request came in; "truncated":true follows the array when
+ * the ring overwrote some of them before they were sent.
+ */
+#define HISTORY_POINT_MAX_LEN 96
+
+struct history_stream {
+	struct http_client_ctx *client;            // NULL when the slot is free
+	int room_id;
+	enum history_res res;
+	uint32_t first;                            // Sequence of the oldest point when the request came in
+	uint32_t next;                             // Sequence of the next point to send
+	uint32_t end;                              // One past the newest point when the request came in
+	char chunk[CONFIG_SMARTHOME_HISTORY_CHUNK_SIZE];
+};
+
+static struct history_stream history_streams[CONFIG_HTTP_SERVER_MAX_CLIENTS];
+
+/* Finds "key=" in the query string of the request url, returns the value length or -1 */
+static int url_query_get(const char *url, const char *key, const char **value)
+{
+	const char *p = strchr(url, '?');
+	size_t key_len = strlen(key);
+
+	while (p != NULL) {
+		p++;
+		if (strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+			*value = p + key_len + 1;
+			return strcspn(*value, "&");
+		}
+		p = strchr(p, '&');
+	}
+	return -1;
+}
+
+static struct history_stream *history_stream_open(struct http_client_ctx *client)
+{
+	const char *url = (const char *)client->url_buffer;
+	const char *value;
+	int len;
+
+	struct history_stream *stream = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(history_streams); i++) {
+		if (history_streams[i].client == NULL) {
+			stream = &history_streams[i];
+			break;
+		}
+	}
+	if (stream == NULL) {
+		return NULL;
+	}
+
+	len = url_query_get(url, "room", &value);
+	stream->room_id = len > 0 ? strtol(value, NULL, 10) : -1;
+	len = url_query_get(url, "res", &value);
+	stream->res = len > 0 ? history_res_from_str(value, len) : HISTORY_RES_RAW;
+	if (stream->room_id < 0 || stream->room_id >= ROOM_COUNT ||
+	    stream->res == HISTORY_RES_COUNT) {
+		return NULL;
+	}
+
+	// The response covers the points stored when it started, later samples don't shift it
+	history_range(stream->room_id, stream->res, &stream->first, &stream->end);
+	stream->next = stream->first;
+	stream->client = client;
+	return stream;
+}
+
+static struct history_stream *history_stream_find(struct http_client_ctx *client)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(history_streams); i++) {
+		if (history_streams[i].client == client) {
+			return &history_streams[i];
+		}
+	}
+	return NULL;
+}
+
+static int history_format_point(char *buf, size_t len, enum history_res res,
+				const struct history_point *p)
+{
+	if (res == HISTORY_RES_RAW) {
+		return snprintk(buf, len, "[%u,%d,%u]", p->time_s, p->temp_avg, p->hum_avg);
+	}
+	return snprintk(buf, len, "[%u,%d,%d,%d,%u,%u,%u]", p->time_s,
+			p->temp_min, p->temp_avg, p->temp_max, p->hum_min, p->hum_avg, p->hum_max);
+}
+
+static int history_get_handler(struct http_client_ctx *client, enum http_data_status status,
+		       const struct http_request_ctx *request_ctx,
+		       struct http_response_ctx *response_ctx, void *user_data)
+{
+	static const char *const res_names[HISTORY_RES_COUNT] = { "raw", "1m", "15m" };
+	struct history_stream *stream = history_stream_find(client);
+
+	if (status == HTTP_SERVER_DATA_ABORTED) {
+		if (stream != NULL) {
+			stream->client = NULL;
+		}
+		return 0;
+	}
+
+	if (status != HTTP_SERVER_DATA_FINAL) {
+		return 0;
+	}
+
+	size_t len = 0;
+	if (stream == NULL) {
+		stream = history_stream_open(client);
+		if (stream == NULL) {
+			http_response(response_ctx, 400, NULL, 0, true);
+			return 0;
+		}
+		len = snprintk(stream->chunk, sizeof(stream->chunk), "{\"now\":%u,\"res\":\"%s\",\"points\":[",
+			       (uint32_t)(k_uptime_get() / MSEC_PER_SEC), res_names[stream->res]);
+	}
+
+	/* Fill the chunk with as many points as fit, the server calls back for the next one */
+	struct history_point point;
+	bool overwritten = false;
+	while (len + HISTORY_POINT_MAX_LEN < sizeof(stream->chunk) && stream->next != stream->end) {
+		if (history_read(stream->room_id, stream->res, stream->next, &point) != 0) {
+			// The ring wrapped over points not sent yet, end here rather than skip them
+			overwritten = true;
+			break;
+		}
+		if (stream->next != stream->first) {
+			stream->chunk[len++] = ',';
+		}
+		len += history_format_point(stream->chunk + len, sizeof(stream->chunk) - len,
+					    stream->res, &point);
+		stream->next++;
+	}
+
+	// A full chunk closes the array in the next callback
+	bool final = (overwritten || stream->next == stream->end) &&
+		     len + HISTORY_POINT_MAX_LEN < sizeof(stream->chunk);
+	if (final) {
+		len += snprintk(stream->chunk + len, sizeof(stream->chunk) - len,
+				overwritten ? "],\"truncated\":true}" : "]}");
+		stream->client = NULL;
+	}
+
+	http_response(response_ctx, 200, stream->chunk, len, final);
+	return 0;
+}
+
+/* Metrics are rendered line by line from one snapshot taken when the request
+ * starts, as many lines per chunk as fit. Scrapes are rare, so a single stream
+ * serves them one at a time and a concurrent scrape gets 503.
+ */
+struct metrics_stream {
+	struct http_client_ctx *client;            // NULL when free
+	size_t next;                               // Index of the next line to send
+	struct metrics_snapshot snap;
+	char chunk[CONFIG_SMARTHOME_METRICS_CHUNK_SIZE];
+};
 
+static struct metrics_stream metrics_stream;
+
+static int metrics_get_handler(struct http_client_ctx *client, enum http_data_status status,
+		       const struct http_request_ctx *request_ctx,
+		       struct http_response_ctx *response_ctx, void *user_data)
+{
+	struct metrics_stream *stream = &metrics_stream;
+
+	if (status == HTTP_SERVER_DATA_ABORTED) {
+		if (stream->client == client) {
+			stream->client = NULL;
+		}
+		return 0;
+	}
+
+	if (status != HTTP_SERVER_DATA_FINAL) {
+		return 0;
+	}
+
+	if (stream->client != client) {
+		if (stream->client != NULL) {
+			http_response(response_ctx, 503, NULL, 0, true);
+			return 0;
+		}
+		stream->client = client;
+		stream->next = 0;
+		metrics_snapshot_take(&stream->snap);
+	}
+
+	size_t len = 0;
+	int ret;
+	while ((ret = metrics_format_line(&stream->snap, stream->next, stream->chunk + len,
+					  sizeof(stream->chunk) - len - 1)) != 0) {
 		if (ret < 0) {
-			LOG_ERR("Failed to encode JSON: %d", ret);
-			http_response(response_ctx, 500, NULL, 0, true);
-			return -1;
+			if (len > 0) {
+				break;
+			}
+			/* Doesn't even fit an empty chunk, skip it rather than stall */
+			LOG_ERR("Metrics line %zu exceeds the chunk size", stream->next);
+			stream->next++;
+			continue;
 		}
+		len += ret;
+		stream->chunk[len++] = '\n';
+		stream->next++;
+	}
 
-		size_t json_len = strlen(json_buf);
-		http_response(response_ctx, 200, json_buf, json_len, true);
+	bool final = ret == 0;
+	if (final) {
+		stream->client = NULL;
 	}
+
+	http_response(response_ctx, 200, stream->chunk, len, final);
 	return 0;
 }
 
@@ -326,7 +868,7 @@ static struct http_resource_detail_dynamic led_resource_detail = {
 			.bitmask_of_supported_http_methods = BIT(HTTP_POST),
 		},
 	.cb = post_handler,
-	.user_data = &led_post_state,
+	.user_data = (void *)&led_post_state,
 };
 
 static struct http_resource_detail_dynamic room_light_resource_detail = {
@@ -335,7 +877,7 @@ static struct http_resource_detail_dynamic room_light_resource_detail = {
 			.bitmask_of_supported_http_methods = BIT(HTTP_POST),
 		},
 	.cb = post_handler,
-	.user_data = &room_light_post_state,
+	.user_data = (void *)&room_light_post_state,
 };
 
 static struct http_resource_detail_dynamic room_temp_resource_detail = {
@@ -344,7 +886,16 @@ static struct http_resource_detail_dynamic room_temp_resource_detail = {
 			.bitmask_of_supported_http_methods = BIT(HTTP_POST),
 		},
 	.cb = post_handler,
-	.user_data = &room_temp_post_state,
+	.user_data = (void *)&room_temp_post_state,
+};
+
+static struct http_resource_detail_dynamic batch_resource_detail = {
+	.common = {
+			.type = HTTP_RESOURCE_TYPE_DYNAMIC,
+			.bitmask_of_supported_http_methods = BIT(HTTP_POST),
+		},
+	.cb = post_handler,
+	.user_data = (void *)&batch_post_state,
 };
 
 static struct http_resource_detail_dynamic room_command_detail = {
@@ -355,160 +906,865 @@ static struct http_resource_detail_dynamic room_command_detail = {
 	.cb = rooms_get_handler,
 	.user_data = NULL,
 };
+static struct http_resource_detail_dynamic history_detail = {
+	.common = {
+			.type = HTTP_RESOURCE_TYPE_DYNAMIC,
+			.bitmask_of_supported_http_methods = BIT(HTTP_GET),
+		},
+	.cb = history_get_handler,
+	.user_data = NULL,
+};
+static struct http_resource_detail_dynamic metrics_detail = {
+	.common = {
+			.type = HTTP_RESOURCE_TYPE_DYNAMIC,
+			.bitmask_of_supported_http_methods = BIT(HTTP_GET),
+			.content_type = "text/plain; version=0.0.4",
+		},
+	.cb = metrics_get_handler,
+	.user_data = NULL,
+};
 /* END HTTP resource definitions */
 
 /* WEB sockets */
-#define MAX_WS_CLIENTS 5
-static int ws_clients[MAX_WS_CLIENTS] = {0};
 static uint8_t number_of_clients_connected = 0;
-static uint8_t ws_buffer[256];
-static uint8_t ws_tx_buffer[256];
+static uint8_t clients_per_protocol[WS_PROTOCOL_COUNT];
+static uint8_t ws_tx_buffer[CONFIG_SMARTHOME_WS_MAX_FRAME_SIZE];
+static uint8_t ws_bin_tx_buffer[CONFIG_SMARTHOME_WS_MAX_FRAME_SIZE];
+
+/* Encoded frames are shared by every client queue and freed by the last reference */
+/* Latency stamps of the first web event in a frame */
+struct ws_frame_stamps {
+	uint32_t origin_cycles;
+	uint32_t dequeued_cycles;                  // When ws_thread took it from web_events_fifo
+};
+
+struct ws_frame {
+	atomic_t refs;
+	size_t len;
+	enum ws_protocol protocol;
+	struct ws_frame_stamps stamps;             // Zero for acks
+	uint8_t data[CONFIG_SMARTHOME_WS_MAX_FRAME_SIZE];
+};
+
+K_MEM_SLAB_DEFINE_STATIC(ws_frame_slab, sizeof(struct ws_frame),
+			 CONFIG_SMARTHOME_WS_FRAME_POOL_SIZE, sizeof(void *));
+
+/* Each client owns a bounded ring of frames, only ws_thread touches the queue */
+struct ws_client {
+	int sock;                       // 0 when the slot is free
+	uint32_t generation;            // Bumped for every client taking the slot
+	bool closing;                   // Receive side saw a close, ws_thread disconnects it
+	enum ws_protocol protocol;
+	uint8_t ctx_buffer;             // Index in ws_ctx_buffers the socket was registered with
+	struct ws_frame *queue[CONFIG_SMARTHOME_WS_CLIENT_QUEUE_DEPTH];
+	uint8_t head;
+	uint8_t count;
+	struct ws_client_stats stats;
+};
+
+static struct ws_client ws_clients[MAX_WS_CLIENTS];
+K_MUTEX_DEFINE(ws_clients_lock);
+
+/* A WebSocket context keeps partial frames in the buffer it was registered with, so
+ * every client needs its own. The HTTP server registers an upgraded socket with the
+ * resource's data_buffer before it calls ws_setup(), so both resources always point
+ * at a buffer no client owns: ws_setup() hands it to the new slot and points them at
+ * another free one. With one buffer more than slots there always is one. Ownership
+ * is guarded by ws_clients_lock, the resources are only changed on the HTTP thread.
+ */
+static uint8_t ws_ctx_buffers[MAX_WS_CLIENTS + 1][256];
+static bool ws_ctx_buffer_used[MAX_WS_CLIENTS + 1];
+static uint8_t ws_ctx_buffer_next;
+extern struct http_resource_detail_websocket ws_resource_detail;
+extern struct http_resource_detail_websocket ws_bin_resource_detail;
+
+static void ws_ctx_buffer_advance(void)
+{
+	for (uint8_t i = 0; i < ARRAY_SIZE(ws_ctx_buffers); i++) {
+		if (!ws_ctx_buffer_used[i]) {
+			ws_ctx_buffer_next = i;
+			ws_resource_detail.data_buffer = ws_ctx_buffers[i];
+			ws_bin_resource_detail.data_buffer = ws_ctx_buffers[i];
+			return;
+		}
+	}
+	__ASSERT(false, "All WebSocket context buffers in use");
+}
+
+/* Requests from ws_rx_thread to ws_thread: an ack frame for one client, or a
+ * disconnect when frame is NULL. Only ws_thread touches the client queues.
+ * A client is its slot and generation, so a request outliving its client is
+ * dropped instead of reaching the next one on the slot or the same descriptor.
+ */
+struct ws_client_ref {
+	uint8_t slot;
+	uint32_t generation;
+};
+
+struct ws_request {
+	struct ws_client_ref client;
+	struct ws_frame *frame;
+};
+
+K_MSGQ_DEFINE(ws_request_msgq, sizeof(struct ws_request), CONFIG_SMARTHOME_WS_FRAME_POOL_SIZE, 4);
+
+/* Wakes ws_rx_thread whenever the set of connected sockets changes */
+static int ws_rx_event = -1;
+
+static void ws_rx_wake(void)
+{
+	if (ws_rx_event >= 0) {
+		eventfd_write(ws_rx_event, 1);
+	}
+}
 
 int ws_setup(int ws_socket, struct http_request_ctx *req_ctx, void *user_data)
 {
     uint64_t start_time = k_uptime_get();
+    k_mutex_lock(&ws_clients_lock, K_FOREVER);
     for (int i = 0; i < MAX_WS_CLIENTS; i++) {
-        if (ws_clients[i] <= 0) {
-            ws_clients[i] = ws_socket;
-            LOG_INF("WebSocket client connected (slot %d)", i);
+        if (ws_clients[i].sock <= 0) {
+            // ws_thread scans the slots without the lock, a live sock must come with the new fields
+            ws_clients[i].generation++;
+            ws_clients[i].closing = false;
+            ws_clients[i].protocol = POINTER_TO_UINT(user_data);
+            ws_clients[i].head = 0;
+            ws_clients[i].count = 0;
+            ws_clients[i].ctx_buffer = ws_ctx_buffer_next;
+            ws_ctx_buffer_used[ws_ctx_buffer_next] = true;
+            ws_ctx_buffer_advance();
+            barrier_dmem_fence_full();
+            ws_clients[i].sock = ws_socket;
+            LOG_INF("WebSocket client connected (slot %d, %s)", i,
+                    ws_clients[i].protocol == WS_PROTOCOL_BINARY ? "binary" : "json");
             number_of_clients_connected++;
+            clients_per_protocol[ws_clients[i].protocol]++;
+            k_mutex_unlock(&ws_clients_lock);
+            ws_rx_wake();
             uint64_t end_time = k_uptime_get();
             LOG_DBG("WebSocket setup time: %llu ms", end_time - start_time);
             return 0;
         }
     }
+    k_mutex_unlock(&ws_clients_lock);
     LOG_ERR("No free WebSocket slots");
     uint64_t end_time = k_uptime_get();
     LOG_DBG("WebSocket setup time (failure): %llu ms", end_time - start_time);
     return -ENOMEM;
 }
 
+int ws_get_client_stats(int slot, struct ws_client_stats *stats)
+{
+	if (slot < 0 || slot >= MAX_WS_CLIENTS) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&ws_clients_lock, K_FOREVER);
+	*stats = ws_clients[slot].stats;
+	stats->connected = ws_clients[slot].sock > 0;
+	stats->protocol = ws_clients[slot].protocol;
+	stats->queue_depth = ws_clients[slot].count;
+	k_mutex_unlock(&ws_clients_lock);
+	return 0;
+}
+
+static void ws_frame_unref(struct ws_frame *frame)
+{
+	if (atomic_dec(&frame->refs) == 1) {
+		k_mem_slab_free(&ws_frame_slab, frame);
+	}
+}
+
+static struct ws_frame *ws_client_pop(struct ws_client *client)
+{
+	struct ws_frame *frame = client->queue[client->head];
+
+	client->head = (client->head + 1) % CONFIG_SMARTHOME_WS_CLIENT_QUEUE_DEPTH;
+	client->count--;
+	return frame;
+}
+
+static void ws_client_disconnect(struct ws_client *client)
+{
+	// Take the socket out of the receive poll before it is closed and its descriptor reused
+	k_mutex_lock(&ws_clients_lock, K_FOREVER);
+	client->closing = true;
+	k_mutex_unlock(&ws_clients_lock);
+	ws_rx_wake();
+
+	while (client->count > 0) {
+		ws_frame_unref(ws_client_pop(client));
+	}
+
+	websocket_unregister(client->sock);
+
+	k_mutex_lock(&ws_clients_lock, K_FOREVER);
+	ws_ctx_buffer_used[client->ctx_buffer] = false;
+	client->sock = 0;
+	client->stats.disconnects++;
+	number_of_clients_connected--;
+	clients_per_protocol[client->protocol]--;
+	k_mutex_unlock(&ws_clients_lock);
+	ws_rx_wake();
+}
+
+static void ws_client_drop_oldest(struct ws_client *client)
+{
+	ws_frame_unref(ws_client_pop(client));
+	client->stats.drops++;
+}
+
+static struct ws_frame *ws_frame_alloc(void)
+{
+	struct ws_frame *frame;
+
+	while (k_mem_slab_alloc(&ws_frame_slab, (void **)&frame, K_NO_WAIT) != 0) {
+		/* Pool exhausted: the slowest client gives up its oldest frame */
+		struct ws_client *slowest = NULL;
+		for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+			if (ws_clients[i].count > 0 &&
+			    (slowest == NULL || ws_clients[i].count > slowest->count)) {
+				slowest = &ws_clients[i];
+			}
+		}
+		if (slowest == NULL) {
+			return NULL;
+		}
+		ws_client_drop_oldest(slowest);
+	}
+
+	atomic_set(&frame->refs, 0);
+	return frame;
+}
+
+static void ws_client_push(struct ws_client *client, struct ws_frame *frame)
+{
+	if (client->count == CONFIG_SMARTHOME_WS_CLIENT_QUEUE_DEPTH) {
+		if (IS_ENABLED(CONFIG_SMARTHOME_WS_OVERFLOW_DISCONNECT)) {
+			LOG_WRN("Client %d can't keep up, disconnecting", (int)(client - ws_clients));
+			ws_client_disconnect(client);
+			return;
+		}
+		ws_client_drop_oldest(client);
+	}
+
+	uint8_t tail = (client->head + client->count) % CONFIG_SMARTHOME_WS_CLIENT_QUEUE_DEPTH;
+	client->queue[tail] = frame;
+	client->count++;
+	atomic_inc(&frame->refs);
+	if (client->count > client->stats.max_queue_depth) {
+		client->stats.max_queue_depth = client->count;
+	}
+}
 
-// This thread will be responsible for sending data to all connected websocket clients
-// it will not handle receiving data from clients
+/* Sends queued frames to every client whose socket can take them right now */
+static void ws_clients_send_pending(void)
+{
+	struct zsock_pollfd fds[MAX_WS_CLIENTS];
+	struct ws_client *polled[MAX_WS_CLIENTS];
+	int nfds = 0;
+
+	for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+		if (ws_clients[i].sock > 0 && ws_clients[i].count > 0) {
+			fds[nfds].fd = ws_clients[i].sock;
+			fds[nfds].events = ZSOCK_POLLOUT;
+			fds[nfds].revents = 0;
+			polled[nfds++] = &ws_clients[i];
+		}
+	}
+
+	if (nfds == 0 || zsock_poll(fds, nfds, 0) <= 0) {
+		return;
+	}
+
+	for (int i = 0; i < nfds; i++) {
+		struct ws_client *client = polled[i];
+
+		if (fds[i].revents & (ZSOCK_POLLERR | ZSOCK_POLLHUP | ZSOCK_POLLNVAL)) {
+			LOG_INF("Client %d disconnected, freeing slot", (int)(client - ws_clients));
+			ws_client_disconnect(client);
+			continue;
+		}
+		if (!(fds[i].revents & ZSOCK_POLLOUT)) {
+			continue;
+		}
+
+		while (client->count > 0) {
+			struct ws_frame *frame = client->queue[client->head];
+			int res = websocket_send_msg(client->sock,
+										frame->data,
+										frame->len,
+										frame->protocol == WS_PROTOCOL_BINARY ?
+											WEBSOCKET_OPCODE_DATA_BINARY :
+											WEBSOCKET_OPCODE_DATA_TEXT,
+										false,
+										true,
+										CONFIG_SMARTHOME_WS_SEND_TIMEOUT_MS);
+			if (res < 0) {
+				/* A partially written frame can't be resumed, drop the client */
+				LOG_INF("Client %d send failed (%d), freeing slot",
+					(int)(client - ws_clients), res);
+				ws_client_disconnect(client);
+				break;
+			}
+			latency_record(LATENCY_WEB_EVENT_SEND, frame->stamps.dequeued_cycles);
+			latency_record(LATENCY_WEB_EVENT_TOTAL, frame->stamps.origin_cycles);
+			ws_frame_unref(ws_client_pop(client));
+		}
+	}
+}
+
+static bool ws_clients_have_pending(void)
+{
+	for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+		if (ws_clients[i].sock > 0 && ws_clients[i].count > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Encodes a single web event as a JSON object, returns its length or a negative error */
+static int ws_encode_web_event(const struct WebEvent *web_event, uint8_t *buf, size_t buf_len)
+{
+	switch (web_event->value_type) {
+		case LIGHT_EV:
+			return ws_encode_room_light(buf, buf_len, web_event->room_id, web_event->value);
+		case HEAT_EV:
+		case HUM_EV: {
+			struct room_state state = { 0 };
+			room_state_get(web_event->room_id, &state);
+			int32_t temp_value = (web_event->value_type == HEAT_EV) ? web_event->value : state.temp_sensor_value;
+			int32_t hum_value = (web_event->value_type == HUM_EV) ? web_event->value : state.hum_sensor_value;
+			return ws_encode_room_temp_read(buf, buf_len, web_event->room_id, temp_value, hum_value);
+		}
+		case SETPOINT_EV:
+			return ws_encode_room_temp_set(buf, buf_len, web_event->room_id, web_event->value);
+		case HEAT_RELAY_EV:
+			return ws_encode_room_temp_heat_relay(buf, buf_len, web_event->room_id, web_event->value);
+		default:
+			LOG_WRN("Unknown web event type: %d", web_event->value_type);
+			return -EINVAL;
+	}
+}
+
+/* Queues one frame for every client speaking the protocol, sending happens in ws_clients_send_pending() */
+static void ws_broadcast(const uint8_t *data, size_t len, enum ws_protocol protocol,
+			 const struct ws_frame_stamps *stamps)
+{
+	struct ws_frame *frame = ws_frame_alloc();
+	if (frame == NULL) {
+		LOG_ERR("No WebSocket frame available");
+		return;
+	}
+
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	frame->protocol = protocol;
+	frame->stamps = *stamps;
+
+	/* Hold a reference so a disconnect in the loop can't free the frame under us */
+	atomic_set(&frame->refs, 1);
+	for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+		if (ws_clients[i].sock <= 0 || ws_clients[i].protocol != protocol) continue;
+		ws_client_push(&ws_clients[i], frame);
+	}
+	ws_frame_unref(frame);
+}
+
+/* Updates are batched into one JSON array per frame: [{...},{...}] */
+static size_t ws_frame_len;
+static struct ws_frame_stamps ws_json_stamps;
+
+static void ws_frame_flush(void)
+{
+	if (ws_frame_len <= 1) {
+		ws_frame_len = 0;
+		return;
+	}
+
+	ws_tx_buffer[ws_frame_len++] = ']';
+	LOG_DBG("Sending frame: %.*s", (int)ws_frame_len, ws_tx_buffer);
+	ws_broadcast(ws_tx_buffer, ws_frame_len, WS_PROTOCOL_JSON, &ws_json_stamps);
+	ws_frame_len = 0;
+	ws_json_stamps = (struct ws_frame_stamps){ 0 };
+	ws_clients_send_pending();
+}
+
+static void ws_frame_append(const struct WebEvent *web_event, uint32_t dequeued_cycles)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (ws_frame_len == 0) {
+			ws_tx_buffer[ws_frame_len++] = '[';
+		}
+
+		/* Leave space for the separator and the closing bracket */
+		size_t offset = ws_frame_len + (ws_frame_len > 1 ? 1 : 0);
+		if (offset + 1 < sizeof(ws_tx_buffer)) {
+			int ret = ws_encode_web_event(web_event, ws_tx_buffer + offset,
+										sizeof(ws_tx_buffer) - offset - 1);
+			if (ret >= 0) {
+				if (offset > ws_frame_len) {
+					ws_tx_buffer[ws_frame_len] = ',';
+				}
+				ws_frame_len = offset + ret;
+				if (ws_json_stamps.dequeued_cycles == 0) {
+					ws_json_stamps.origin_cycles = web_event->origin_cycles;
+					ws_json_stamps.dequeued_cycles = dequeued_cycles;
+				}
+				return;
+			}
+			if (ret != -ENOMEM) {
+				LOG_ERR("Encoding failed: %d", ret);
+				return;
+			}
+		}
+
+		if (ws_frame_len <= 1) {
+			break;
+		}
+		/* Frame is full, send what we have and start a new one */
+		ws_frame_flush();
+	}
+
+	LOG_ERR("Web event does not fit in a %zu byte frame", sizeof(ws_tx_buffer));
+}
+
+/* Binary frames are a plain sequence of fixed 8 byte records:
+ * room_id (u8), value_type (u8), reserved (u16), value (u32 little endian)
+ */
+#define WS_BIN_RECORD_SIZE 8
+
+static size_t ws_bin_frame_len;
+static struct ws_frame_stamps ws_bin_frame_stamps;
+
+static void ws_bin_frame_flush(void)
+{
+	if (ws_bin_frame_len == 0) {
+		return;
+	}
+
+	ws_broadcast(ws_bin_tx_buffer, ws_bin_frame_len, WS_PROTOCOL_BINARY, &ws_bin_frame_stamps);
+	ws_bin_frame_len = 0;
+	ws_bin_frame_stamps = (struct ws_frame_stamps){ 0 };
+	ws_clients_send_pending();
+}
+
+static void ws_bin_frame_append(const struct WebEvent *web_event, uint32_t dequeued_cycles)
+{
+	if (ws_bin_frame_len + WS_BIN_RECORD_SIZE > sizeof(ws_bin_tx_buffer)) {
+		ws_bin_frame_flush();
+	}
+	if (ws_bin_frame_len == 0) {
+		ws_bin_frame_stamps.origin_cycles = web_event->origin_cycles;
+		ws_bin_frame_stamps.dequeued_cycles = dequeued_cycles;
+	}
+
+	uint8_t *record = ws_bin_tx_buffer + ws_bin_frame_len;
+	record[0] = web_event->room_id;
+	record[1] = web_event->value_type;
+	sys_put_le16(0, &record[2]);
+	sys_put_le32(web_event->value, &record[4]);
+	ws_bin_frame_len += WS_BIN_RECORD_SIZE;
+}
+
+/* Hands acks to their client queue and drops clients the receive side saw closing */
+static void ws_service_requests(void)
+{
+	struct ws_request req;
+
+	while (k_msgq_get(&ws_request_msgq, &req, K_NO_WAIT) == 0) {
+		struct ws_client *client = &ws_clients[req.client.slot];
+
+		// Only ws_thread frees a slot and ws_setup() only takes free ones, the generation is stable here
+		if (client->sock <= 0 || client->generation != req.client.generation) {
+			client = NULL;
+		}
+
+		if (req.frame == NULL) {
+			if (client != NULL) {
+				LOG_INF("Client %d closed, freeing slot", (int)(client - ws_clients));
+				ws_client_disconnect(client);
+			}
+			continue;
+		}
+
+		atomic_set(&req.frame->refs, 1);
+		if (client != NULL) {
+			ws_client_push(client, req.frame);
+		}
+		ws_frame_unref(req.frame);
+	}
+}
+
+// This thread will be responsible for sending data to all connected websocket clients,
+// receiving is done by ws_rx_thread
 void ws_thread(void *arg1, void *arg2, void *arg3)
 {
     (void)arg1; (void)arg2; (void)arg3;
 
+    struct k_poll_event wait_events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_FIFO_DATA_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY,
+                                 &web_events_fifo),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_MSGQ_DATA_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY,
+                                 &ws_request_msgq),
+    };
+
     while (1) {
 
-        // Process all pending web events
-        struct WebEvent *new_web_event = k_fifo_get(&web_events_fifo, K_NO_WAIT);
-        if (new_web_event == NULL) {
-            k_msleep(200);
-            continue;
+        // Sleep until there is something to send, waking up periodically while a client has a backlog
+        k_timeout_t wait = ws_clients_have_pending() ? K_MSEC(CONFIG_SMARTHOME_WS_RETRY_MS) : K_FOREVER;
+        k_poll(wait_events, ARRAY_SIZE(wait_events), wait);
+        for (size_t i = 0; i < ARRAY_SIZE(wait_events); i++) {
+            wait_events[i].state = K_POLL_STATE_NOT_READY;
         }
 
-        // Skip event processing if no clients are connected
-        if (number_of_clients_connected == 0) {
-            k_free(new_web_event);
-            k_msleep(200);
-            continue;
+        ws_service_requests();
+
+        struct WebEvent *new_web_event = web_event_get(K_NO_WAIT);
+        k_timepoint_t flush_at = sys_timepoint_calc(K_MSEC(CONFIG_SMARTHOME_WS_FLUSH_WINDOW_MS));
+
+        // Collect everything that arrives within the flush window into as few frames as possible
+        while (new_web_event != NULL) {
+            uint32_t dequeued_cycles = latency_stamp();
+            latency_record(LATENCY_WEB_EVENT_QUEUE, new_web_event->created_cycles);
+
+            LOG_DBG("Web event: room %d, type %d, value %d",
+                    new_web_event->room_id,
+                    new_web_event->value_type,
+                    new_web_event->value);
+
+            // Only encode the formats somebody is listening to
+            if (clients_per_protocol[WS_PROTOCOL_JSON] > 0) {
+                ws_frame_append(new_web_event, dequeued_cycles);
+            }
+            if (clients_per_protocol[WS_PROTOCOL_BINARY] > 0) {
+                ws_bin_frame_append(new_web_event, dequeued_cycles);
+            }
+            web_event_free(new_web_event);
+
+            new_web_event = web_event_get(sys_timepoint_timeout(flush_at));
         }
 
-        LOG_DBG("Sending data");
-		LOG_DBG("Web event: room %d, type %d, value %d",
-				new_web_event->room_id,
-				new_web_event->value_type,
-				new_web_event->value);
-
-		int ret = 0;
-		switch (new_web_event->value_type) {
-			case LIGHT_EV: {
-				struct room_light_command room_light_data;
-				room_light_data.room_id = new_web_event->room_id;
-				room_light_data.light_value = new_web_event->value;
-
-				ret = json_obj_encode_buf(room_light_command_descr,
-											ARRAY_SIZE(room_light_command_descr),
-											&room_light_data,
-											ws_tx_buffer,
-											sizeof(ws_tx_buffer));
-				break;
+        ws_frame_flush();
+        ws_bin_frame_flush();
+        ws_clients_send_pending();
+    }
+}
+
+/* Commands sent by the clients, on both /ws and /ws/bin, as JSON text frames:
+ *   {"id":7,"cmd":"light","body":{"room_id":0,"light_value":1}}
+ * body is exactly what the matching REST resource takes. Every command is
+ * answered on the same socket with {"ack":7,"status":200} plus a "result"
+ * holding the REST response body, if there is one.
+ */
+struct ws_command {
+	int id;
+	const char *cmd;
+	int body;                                  // Placeholder, see ws_handle_command()
+};
+static const struct json_obj_descr ws_command_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct ws_command, id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct ws_command, cmd, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct ws_command, body, JSON_TOK_NUMBER),
+};
+
+static const struct {
+	const char *name;
+	const struct post_state *state;
+} ws_commands[] = {
+	{ "led", &led_post_state },
+	{ "light", &room_light_post_state },
+	{ "temp", &room_temp_post_state },
+	{ "batch", &batch_post_state },
+};
+
+/* Only used by ws_rx_thread */
+static char ws_rx_buffer[CONFIG_SMARTHOME_WS_RX_SIZE + 1];
+static char ws_rx_envelope[CONFIG_SMARTHOME_WS_RX_SIZE + 1];
+static char ws_rx_reply[CONFIG_SMARTHOME_POST_BODY_SIZE];
+
+/* Returns the index just past the object or array starting at buf[start], 0 if unterminated */
+static size_t ws_json_container_end(const char *buf, size_t len, size_t start)
+{
+	int depth = 0;
+	bool in_string = false;
+
+	for (size_t i = start; i < len; i++) {
+		char c = buf[i];
+
+		if (in_string) {
+			if (c == '\\') {
+				i++;
+			} else if (c == '"') {
+				in_string = false;
 			}
-			case HEAT_EV:
-			case HUM_EV: {
-				struct Room *r = get_room_by_id(new_web_event->room_id);
-				struct room_temp_read_command room_data;
-				room_data.room_id = new_web_event->room_id;
-				room_data.temp_value = (new_web_event->value_type == HEAT_EV) ? new_web_event->value : (r ? r->temp_sensor_value : 0);
-    			room_data.hum_value = (new_web_event->value_type == HUM_EV) ? new_web_event->value : (r ? r->hum_sensor_value : 0);
-				ret = json_obj_encode_buf(room_temp_command_descr,
-												ARRAY_SIZE(room_temp_command_descr),
-												&room_data,
-												ws_tx_buffer,
-												sizeof(ws_tx_buffer));
-				break;
+		} else if (c == '"') {
+			in_string = true;
+		} else if (c == '{' || c == '[') {
+			depth++;
+		} else if ((c == '}' || c == ']') && --depth == 0) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/* Locates the object or array value of the top level "body" key */
+static bool ws_find_body(const char *buf, size_t len, size_t *start, size_t *end)
+{
+	static const char key[] = "\"body\"";
+	int depth = 0;
+	bool in_string = false;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+
+		if (in_string) {
+			if (c == '\\') {
+				i++;
+			} else if (c == '"') {
+				in_string = false;
 			}
-			case SETPOINT_EV: {
-				struct room_temp_set_command room_setpoint_data;
-				room_setpoint_data.room_id = new_web_event->room_id;
-				room_setpoint_data.setpoint_temp_value = new_web_event->value;
-
-				ret = json_obj_encode_buf(room_temp_set_command_descr,
-											ARRAY_SIZE(room_temp_set_command_descr),
-											&room_setpoint_data,
-											ws_tx_buffer,
-											sizeof(ws_tx_buffer));
-				break;
+			continue;
+		}
+
+		if (c == '"' && depth == 1 && len - i > sizeof(key) - 1 &&
+		    memcmp(&buf[i], key, sizeof(key) - 1) == 0) {
+			size_t j = i + sizeof(key) - 1;
+			while (j < len && strchr(" \t\r\n", buf[j]) != NULL) {
+				j++;
+			}
+			if (j < len && buf[j] == ':') {
+				do {
+					j++;
+				} while (j < len && strchr(" \t\r\n", buf[j]) != NULL);
+				if (j < len && (buf[j] == '{' || buf[j] == '[')) {
+					*start = j;
+					*end = ws_json_container_end(buf, len, j);
+					return *end != 0;
+				}
+				return false;
 			}
-			case HEAT_RELAY_EV:
-				struct room_temp_heat_relay_command room_heat_relay_data;
-				room_heat_relay_data.room_id = new_web_event->room_id;
-				room_heat_relay_data.heat_relay_state = new_web_event->value ? true : false;
-				ret = json_obj_encode_buf(room_temp_heat_relay_command_descr,
-											ARRAY_SIZE(room_temp_heat_relay_command_descr),
-											&room_heat_relay_data,
-											ws_tx_buffer,
-											sizeof(ws_tx_buffer));
-				break;
-			default:
-				LOG_WRN("Unknown web event type: %d", new_web_event->value_type);
-				break;
 		}
-		k_free(new_web_event);
 
-		if (ret < 0) {
-			LOG_ERR("Encoding failed: %d", ret);
-			continue;
-		} else if (ret > 0) {
-			LOG_DBG("Encoded successfully!");
-			LOG_DBG("String: %s", ws_tx_buffer);
-			LOG_HEXDUMP_DBG(ws_tx_buffer, strlen(ws_tx_buffer), "JSON raw");
+		if (c == '"') {
+			in_string = true;
+		} else if (c == '{' || c == '[') {
+			depth++;
+		} else if (c == '}' || c == ']') {
+			depth--;
 		}
+	}
+	return false;
+}
 
-		// Send data to all connected clients
-		for (int i = 0; i < MAX_WS_CLIENTS; i++) {
-			if (ws_clients[i] == 0) continue;
+/* Queues a text frame for ws_thread to send to the client */
+static void ws_send_ack(struct ws_client_ref client, int id, int status, const struct post_reply *reply)
+{
+	struct ws_frame *frame;
 
-			int res = websocket_send_msg(ws_clients[i], 
-										ws_tx_buffer, 
-										strlen(ws_tx_buffer),
-										WEBSOCKET_OPCODE_DATA_TEXT,
-										false,
-										true,
-										SYS_FOREVER_MS);
+	if (k_mem_slab_alloc(&ws_frame_slab, (void **)&frame, K_NO_WAIT) != 0) {
+		LOG_WRN("No WebSocket frame for the ack of request %d", id);
+		return;
+	}
 
-			if (res < 0) {
-				LOG_INF("Client %d disconnected, freeing slot", i);
-				websocket_unregister(ws_clients[i]);
-				ws_clients[i] = 0;
-				number_of_clients_connected--;
+	int len;
+	if (reply->len > 0) {
+		len = snprintk((char *)frame->data, sizeof(frame->data), "{\"ack\":%d,\"status\":%d,\"result\":%.*s}",
+			       id, status, (int)reply->len, reply->buf);
+	} else {
+		len = snprintk((char *)frame->data, sizeof(frame->data), "{\"ack\":%d,\"status\":%d}", id, status);
+	}
+	if (len < 0 || len >= sizeof(frame->data)) {
+		len = snprintk((char *)frame->data, sizeof(frame->data), "{\"ack\":%d,\"status\":%d}", id, status);
+	}
+	frame->len = len;
+	frame->protocol = WS_PROTOCOL_JSON;
+	frame->stamps = (struct ws_frame_stamps){ 0 };
+
+	struct ws_request req = { .client = client, .frame = frame };
+	if (k_msgq_put(&ws_request_msgq, &req, K_NO_WAIT) != 0) {
+		LOG_WRN("Ack queue full, dropping ack of request %d", id);
+		k_mem_slab_free(&ws_frame_slab, frame);
+	}
+}
+
+static void ws_handle_command(struct ws_client_ref client, char *buf, size_t len)
+{
+	struct ws_command cmd = { .id = 0 };
+	struct post_reply reply = { .buf = ws_rx_reply, .size = sizeof(ws_rx_reply) };
+	size_t body_start, body_end;
+	int status = 400;
+
+	if (!ws_find_body(buf, len, &body_start, &body_end)) {
+		LOG_WRN("WebSocket command without body");
+		ws_send_ack(client, cmd.id, status, &reply);
+		return;
+	}
+
+	/* The envelope is parsed from a copy where the body is replaced by a plain 0,
+	 * the original body is then handed untouched to the REST parser.
+	 */
+	memcpy(ws_rx_envelope, buf, len);
+	ws_rx_envelope[body_start] = '0';
+	memset(&ws_rx_envelope[body_start + 1], ' ', body_end - body_start - 1);
+
+	int ret = json_obj_parse(ws_rx_envelope, len, ws_command_descr, ARRAY_SIZE(ws_command_descr), &cmd);
+	if (ret < 0 || (ret & (BIT(0) | BIT(1))) != (BIT(0) | BIT(1))) {
+		LOG_WRN("Failed to parse WebSocket command, ret=%d", ret);
+		ws_send_ack(client, cmd.id, status, &reply);
+		return;
+	}
+
+	const struct post_state *state = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(ws_commands); i++) {
+		if (strcmp(ws_commands[i].name, cmd.cmd) == 0) {
+			state = ws_commands[i].state;
+			break;
+		}
+	}
+
+	size_t body_len = body_end - body_start;
+	if (state == NULL) {
+		LOG_WRN("Unknown WebSocket command %s", cmd.cmd);
+		status = 404;
+	} else if (body_len > MIN(state->max_size, CONFIG_SMARTHOME_POST_BODY_SIZE)) {
+		status = 413;
+	} else {
+		// The parser terminates the body in place, buf has room for it past body_end
+		status = state->parser((uint8_t *)&buf[body_start], body_len, &reply) ? 200 : 400;
+	}
+
+	ws_send_ack(client, cmd.id, status, &reply);
+}
+
+static void ws_request_close(struct ws_client_ref client)
+{
+	struct ws_request req = { .client = client, .frame = NULL };
+
+	k_mutex_lock(&ws_clients_lock, K_FOREVER);
+	if (ws_clients[client.slot].generation == client.generation) {
+		ws_clients[client.slot].closing = true;
+	}
+	k_mutex_unlock(&ws_clients_lock);
+
+	k_msgq_put(&ws_request_msgq, &req, K_FOREVER);
+}
+
+/* Reads one message from a readable client socket */
+static void ws_client_receive(struct ws_client_ref client, int sock)
+{
+	size_t len = 0;
+	bool overflow = false;
+	uint32_t message_type = 0;
+	uint64_t remaining = 0;
+
+	do {
+		char *dst = overflow ? ws_rx_envelope : ws_rx_buffer + len;
+		size_t room = overflow ? sizeof(ws_rx_envelope) : sizeof(ws_rx_buffer) - 1 - len;
+
+		int ret = websocket_recv_msg(sock, dst, room, &message_type, &remaining,
+					     len == 0 ? 0 : CONFIG_SMARTHOME_WS_SEND_TIMEOUT_MS);
+		if (ret == -EAGAIN && len == 0) {
+			return;
+		}
+		if (ret < 0 || (message_type & WEBSOCKET_FLAG_CLOSE)) {
+			LOG_DBG("WebSocket receive on %d ended: %d", sock, ret);
+			ws_request_close(client);
+			return;
+		}
+
+		if (!overflow) {
+			len += ret;
+			overflow = remaining > 0 && len == sizeof(ws_rx_buffer) - 1;
+		}
+	} while (remaining > 0);
+
+	if (!(message_type & WEBSOCKET_FLAG_TEXT)) {
+		return;
+	}
+	if (overflow) {
+		LOG_WRN("WebSocket command longer than %d bytes dropped", CONFIG_SMARTHOME_WS_RX_SIZE);
+		return;
+	}
+
+	ws_rx_buffer[len] = '\0';
+	ws_handle_command(client, ws_rx_buffer, len);
+}
+
+/* Waits for commands on every client socket, the eventfd restarts the poll
+ * with the current socket set after a connect or disconnect.
+ */
+static void ws_rx_thread(void *arg1, void *arg2, void *arg3)
+{
+	struct zsock_pollfd fds[MAX_WS_CLIENTS + 1];
+	struct ws_client_ref polled[MAX_WS_CLIENTS + 1];
+
+	while (1) {
+		int nfds = 0;
+
+		fds[nfds].fd = ws_rx_event;
+		fds[nfds].events = ZSOCK_POLLIN;
+		fds[nfds++].revents = 0;
+
+		k_mutex_lock(&ws_clients_lock, K_FOREVER);
+		for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+			if (ws_clients[i].sock > 0 && !ws_clients[i].closing) {
+				polled[nfds].slot = i;
+				polled[nfds].generation = ws_clients[i].generation;
+				fds[nfds].fd = ws_clients[i].sock;
+				fds[nfds].events = ZSOCK_POLLIN;
+				fds[nfds++].revents = 0;
 			}
 		}
+		k_mutex_unlock(&ws_clients_lock);
 
-        k_msleep(200);
-    }
+		if (zsock_poll(fds, nfds, -1) < 0) {
+			LOG_ERR("WebSocket receive poll failed: %d", errno);
+			k_msleep(CONFIG_SMARTHOME_WS_RETRY_MS);
+			continue;
+		}
+
+		if (fds[0].revents & ZSOCK_POLLIN) {
+			// Socket set changed, a descriptor polled above may already be reused
+			eventfd_t value;
+			eventfd_read(ws_rx_event, &value);
+			continue;
+		}
+
+		for (int i = 1; i < nfds; i++) {
+			if (fds[i].revents & ZSOCK_POLLNVAL) {
+				continue;
+			}
+			if (fds[i].revents & (ZSOCK_POLLIN | ZSOCK_POLLERR | ZSOCK_POLLHUP)) {
+				ws_client_receive(polled[i], fds[i].fd);
+			}
+		}
+	}
 }
 
 K_THREAD_STACK_DEFINE(ws_stack, 4096);
 static struct k_thread ws_tid;
+K_THREAD_STACK_DEFINE(ws_rx_stack, 4096);
+static struct k_thread ws_rx_tid;
 
 static int web_init(void)
 {
     k_thread_create(&ws_tid, ws_stack, K_THREAD_STACK_SIZEOF(ws_stack),
                     ws_thread, NULL, NULL, NULL,
                     K_PRIO_PREEMPT(5), 0, K_NO_WAIT);
+    k_thread_name_set(&ws_tid, "ws_tid");
+
+    ws_rx_event = eventfd(0, EFD_NONBLOCK);
+    if (ws_rx_event < 0) {
+        LOG_ERR("No eventfd for the WebSocket receive thread: %d", errno);
+        return 0;
+    }
+    k_thread_create(&ws_rx_tid, ws_rx_stack, K_THREAD_STACK_SIZEOF(ws_rx_stack),
+                    ws_rx_thread, NULL, NULL, NULL,
+                    K_PRIO_PREEMPT(6), 0, K_NO_WAIT);
+    k_thread_name_set(&ws_rx_tid, "ws_rx_tid");
     return 0;
 }
 struct http_resource_detail_websocket ws_resource_detail = {
@@ -517,14 +1773,25 @@ struct http_resource_detail_websocket ws_resource_detail = {
 			.bitmask_of_supported_http_methods = BIT(HTTP_GET),
 		},
 	.cb = ws_setup,
-	.data_buffer = ws_buffer,
-	.data_buffer_len = sizeof(ws_buffer),
-	.user_data = NULL,
+	.data_buffer = ws_ctx_buffers[0],
+	.data_buffer_len = sizeof(ws_ctx_buffers[0]),
+	.user_data = UINT_TO_POINTER(WS_PROTOCOL_JSON),
+};
+
+struct http_resource_detail_websocket ws_bin_resource_detail = {
+	.common = {
+			.type = HTTP_RESOURCE_TYPE_WEBSOCKET,
+			.bitmask_of_supported_http_methods = BIT(HTTP_GET),
+		},
+	.cb = ws_setup,
+	.data_buffer = ws_ctx_buffers[0],
+	.data_buffer_len = sizeof(ws_ctx_buffers[0]),
+	.user_data = UINT_TO_POINTER(WS_PROTOCOL_BINARY),
 };
 
 /* END WEB sockets*/
 
-HTTP_SERVICE_DEFINE(test_http_service, NULL, &ui_port, 4, 10, NULL, NULL, NULL);
+HTTP_SERVICE_DEFINE(test_http_service, NULL, &ui_port, CONFIG_HTTP_SERVER_MAX_CLIENTS, 10, NULL, NULL, NULL);
 
 HTTP_RESOURCE_DEFINE(index_res, test_http_service, "/", &index_detail);
 
@@ -534,9 +1801,17 @@ HTTP_RESOURCE_DEFINE(light_res, test_http_service, "/api/v1/light", &room_light_
 
 HTTP_RESOURCE_DEFINE(temp_res, test_http_service, "/api/v1/temp", &room_temp_resource_detail);
 
+HTTP_RESOURCE_DEFINE(batch_res, test_http_service, "/api/v1/batch", &batch_resource_detail);
+
 HTTP_RESOURCE_DEFINE(room_res, test_http_service, "/api/v1/rooms", &room_command_detail);
 
+HTTP_RESOURCE_DEFINE(history_res, test_http_service, "/api/v1/history", &history_detail);
+
+HTTP_RESOURCE_DEFINE(metrics_res, test_http_service, "/api/v1/metrics", &metrics_detail);
+
 HTTP_RESOURCE_DEFINE(ws_res, test_http_service, "/ws", &ws_resource_detail);
 
+HTTP_RESOURCE_DEFINE(ws_bin_res, test_http_service, "/ws/bin", &ws_bin_resource_detail);
+
 SYS_INIT(web_init, APPLICATION, 0);
 
@@ -0,0 +1,107 @@
+#include <zephyr/sys/util.h>
+#include <string.h>
+#include <errno.h>
+
+#include "WsEncode.h"
+
+const struct json_obj_descr room_light_command_descr[2] = {
+	JSON_OBJ_DESCR_PRIM(struct room_light_command, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_light_command, light_value, JSON_TOK_NUMBER),
+};
+
+const struct json_obj_descr room_temp_command_descr[3] = {
+	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, temp_value, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_read_command, hum_value, JSON_TOK_NUMBER),
+};
+
+const struct json_obj_descr room_temp_set_command_descr[2] = {
+	JSON_OBJ_DESCR_PRIM(struct room_temp_set_command, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_set_command, setpoint_temp_value, JSON_TOK_NUMBER),
+};
+
+const struct json_obj_descr room_temp_heat_relay_command_descr[2] = {
+	JSON_OBJ_DESCR_PRIM(struct room_temp_heat_relay_command, room_id, JSON_TOK_NUMBER),
+	JSON_OBJ_DESCR_PRIM(struct room_temp_heat_relay_command, heat_relay_state, JSON_TOK_TRUE),
+};
+
+/* The encoders write the key text and values straight into the buffer and return
+ * the exact length, producing the same output as json_obj_encode_buf() with the
+ * descriptors above but without walking them.
+ */
+#define WS_MAX_LEN_int  11  // "-2147483648"
+#define WS_MAX_LEN_bool 5   // "false"
+
+static inline size_t ws_put_int(uint8_t *buf, int32_t value)
+{
+	uint8_t digits[10];
+	uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+	size_t count = 0;
+	size_t len = 0;
+
+	do {
+		digits[count++] = '0' + (magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude != 0);
+
+	if (value < 0) {
+		buf[len++] = '-';
+	}
+	while (count > 0) {
+		buf[len++] = digits[--count];
+	}
+	return len;
+}
+
+static inline size_t ws_put_bool(uint8_t *buf, int32_t value)
+{
+	if (value) {
+		memcpy(buf, "true", 4);
+		return 4;
+	}
+	memcpy(buf, "false", 5);
+	return 5;
+}
+
+#define WS_PUT_LITERAL(p, lit) (memcpy((p), (lit), sizeof(lit) - 1), sizeof(lit) - 1)
+#define WS_KEY(first, field) first "\"" #field "\":"
+
+#define WS_ENCODER_2(name, kind1, f1, kind2, f2)                                        \
+int ws_encode_##name(uint8_t *buf, size_t buf_len, int32_t v1, int32_t v2)                \
+{                                                                                         \
+	uint8_t *p = buf;                                                                     \
+	if (buf_len < sizeof(WS_KEY("{", f1) WS_KEY(",", f2) "}") - 1 +                       \
+			WS_MAX_LEN_##kind1 + WS_MAX_LEN_##kind2) {                                \
+		return -ENOMEM;                                                                   \
+	}                                                                                     \
+	p += WS_PUT_LITERAL(p, WS_KEY("{", f1));                                              \
+	p += ws_put_##kind1(p, v1);                                                           \
+	p += WS_PUT_LITERAL(p, WS_KEY(",", f2));                                              \
+	p += ws_put_##kind2(p, v2);                                                           \
+	*p++ = '}';                                                                           \
+	return p - buf;                                                                       \
+}
+
+#define WS_ENCODER_3(name, kind1, f1, kind2, f2, kind3, f3)                               \
+int ws_encode_##name(uint8_t *buf, size_t buf_len, int32_t v1, int32_t v2,                \
+		     int32_t v3)                                                          \
+{                                                                                         \
+	uint8_t *p = buf;                                                                     \
+	if (buf_len < sizeof(WS_KEY("{", f1) WS_KEY(",", f2) WS_KEY(",", f3) "}") - 1 +       \
+			WS_MAX_LEN_##kind1 + WS_MAX_LEN_##kind2 + WS_MAX_LEN_##kind3) {         \
+		return -ENOMEM;                                                                   \
+	}                                                                                     \
+	p += WS_PUT_LITERAL(p, WS_KEY("{", f1));                                              \
+	p += ws_put_##kind1(p, v1);                                                           \
+	p += WS_PUT_LITERAL(p, WS_KEY(",", f2));                                              \
+	p += ws_put_##kind2(p, v2);                                                           \
+	p += WS_PUT_LITERAL(p, WS_KEY(",", f3));                                              \
+	p += ws_put_##kind3(p, v3);                                                           \
+	*p++ = '}';                                                                           \
+	return p - buf;                                                                       \
+}
+
+WS_ENCODER_2(room_light, int, room_id, int, light_value)
+WS_ENCODER_3(room_temp_read, int, room_id, int, temp_value, int, hum_value)
+WS_ENCODER_2(room_temp_set, int, room_id, int, setpoint_temp_value)
+WS_ENCODER_2(room_temp_heat_relay, int, room_id, bool, heat_relay_state)
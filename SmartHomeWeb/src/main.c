@@ -9,6 +9,11 @@
 #include <string.h>
 
 #include "Room.h"
+#include "Web.h"
+#include "Sensor.h"
+#include "History.h"
+#include "Metrics.h"
+#include "Settings.h"
 
 #include <zephyr/sys/sys_heap.h>
 
@@ -20,86 +25,313 @@ void check_memory(void) {
 
     printk("Heap - Free: %zu | Allocated: %zu | Max: %zu\n", 
             stats.free_bytes, stats.allocated_bytes, stats.max_allocated_bytes);
+
+    struct event_pool_stats pool;
+    get_event_pool_stats(&pool);
+    printk("Event pool - Used: %u/%u | Max: %u | Failed: %u\n",
+            pool.used, pool.capacity, pool.max_used, pool.alloc_failures);
+    get_web_event_pool_stats(&pool);
+    printk("WebEvent pool - Used: %u/%u | Max: %u | Failed: %u\n",
+            pool.used, pool.capacity, pool.max_used, pool.alloc_failures);
+
+    struct executor_stats executor;
+    get_executor_stats(&executor);
+    printk("Executor - Applied: %u | Coalesced: %u\n",
+            executor.applied, executor.coalesced);
+    printk("Switch - Presses: %u | Press-to-actuation us last/avg/max: %u/%u/%u\n",
+            executor.switch_actuations, executor.switch_last_us,
+            executor.switch_actuations ?
+                (uint32_t)(executor.switch_total_us / executor.switch_actuations) : 0,
+            executor.switch_max_us);
+
+    for (size_t i = 0; i < hs300x_sensor_count(); i++) {
+        struct sensor_read_stats sensor;
+        const struct device *dev = hs300x_get_stats(i, &sensor);
+        printk("Sensor %s - Reads: %u | Errors: %u | Latency us last/min/avg/max: %u/%u/%u/%u\n",
+                dev->name, sensor.reads, sensor.errors, sensor.last_us,
+                sensor.reads + sensor.errors ? sensor.min_us : 0,
+                sensor.reads + sensor.errors ?
+                    (uint32_t)(sensor.total_us / (sensor.reads + sensor.errors)) : 0,
+                sensor.max_us);
+    }
+
+    struct sensor_cache_stats cache;
+    const struct device *cached_dev;
+    for (size_t i = 0; (cached_dev = sensor_cache_get_stats(i, &cache)) != NULL; i++) {
+        printk("Sensor cache %s - Hits: %u | Misses: %u | Errors: %u\n",
+                cached_dev->name, cache.hits, cache.misses, cache.errors);
+    }
+
+    struct room_settings_stats settings;
+    get_room_settings_stats(&settings);
+    printk("Settings - Restored: %u | Changes: %u | Flash writes: %u (%u bytes) | Unchanged: %u | Errors: %u\n",
+            settings.restored, settings.changes, settings.writes, settings.write_bytes,
+            settings.unchanged, settings.write_errors);
+
+    for (int i = 0; i < MAX_WS_CLIENTS; i++) {
+        struct ws_client_stats ws;
+        ws_get_client_stats(i, &ws);
+        printk("WS slot %d - %s | Queue: %u (max %u) | Drops: %u | Disconnects: %u\n",
+                i, ws.connected ? "connected" : "free", ws.queue_depth,
+                ws.max_queue_depth, ws.drops, ws.disconnects);
+    }
 }
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 
 
-#define SLEEP_TIME_MS 200
 #define STACKSIZE 1024
 #define PRIORITY 7
 
 
-void listening_switch_events_thread(void) {
+/* Wall switches raise an interrupt on both edges. Every edge restarts the
+ * debounce work, so the light follows the switch once the contact has been
+ * stable for CONFIG_SMARTHOME_SWITCH_DEBOUNCE_MS.
+ */
+struct light_switch {
+    struct gpio_callback cb;
+    struct k_work_delayable debounce;
+    const struct Room *room;
+    atomic_t press_cycles;                     // Cycle count of the first edge of a bounce burst, 0 when idle
+    int level;                                 // Last debounced level
+};
 
-    struct Room **rooms = get_all_rooms();
+static struct light_switch light_switches[ROOM_COUNT];
 
-    while (1) {
-        int percentage_ = 90;
+static void light_switch_isr(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins) {
+    struct light_switch *sw = CONTAINER_OF(cb, struct light_switch, cb);
 
-        for (int i = 0; i < STRUCT_ROOM_COUNT; i++) {
+    // Latency is measured from the first edge, the bounces after it only push the deadline.
+    // The low bit is forced so a real timestamp is never mistaken for idle.
+    atomic_cas(&sw->press_cycles, 0, (atomic_val_t)(k_cycle_get_32() | 1));
+    k_work_reschedule(&sw->debounce, K_MSEC(CONFIG_SMARTHOME_SWITCH_DEBOUNCE_MS));
+}
 
-            // uint32_t new_state = gpio_pin_get_dt(rooms[i]->light_switch);
+static void light_switch_debounced(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct light_switch *sw = CONTAINER_OF(dwork, struct light_switch, debounce);
+    uint32_t press_cycles = (uint32_t)atomic_clear(&sw->press_cycles);
 
-            // // In case is a PWM event light needs special value so I calculated it here (90% of brightness for ON state)
-            // new_state = rooms[i]->light_pwm->period * percentage_ / 100;
+    int level = gpio_pin_get_dt(&sw->room->light_switch);
+    if (level < 0) {
+        LOG_ERR("Reading switch of room %d failed: %d", sw->room->room_id, level);
+        return;
+    }
+    if (level == sw->level) {
+        // Bounced back to where it was
+        return;
+    }
+
+    sw->level = level;
+    process_light_switch(sw->room, level ? room_light_on_value(sw->room) : 0, press_cycles);
+}
 
-            // process_light_control(rooms[i], new_state);
+static void light_switches_start(void) {
+    for (int i = 0; i < ROOM_COUNT; i++) {
+        struct light_switch *sw = &light_switches[i];
+        const struct Room *room = get_room_by_id(i);
+
+        if (room->light_switch.port == NULL) {
+            continue;
         }
 
-        k_msleep(SLEEP_TIME_MS);
+        sw->room = room;
+        sw->level = gpio_pin_get_dt(&room->light_switch);
+        k_work_init_delayable(&sw->debounce, light_switch_debounced);
+        gpio_init_callback(&sw->cb, light_switch_isr, BIT(room->light_switch.pin));
+
+        int ret = gpio_add_callback_dt(&room->light_switch, &sw->cb);
+        if (ret == 0) {
+            ret = gpio_pin_interrupt_configure_dt(&room->light_switch, GPIO_INT_EDGE_BOTH);
+        }
+        if (ret != 0) {
+            LOG_ERR("Switch interrupt of room %d failed: %d", room->room_id, ret);
+        }
     }
 }
 
-void listening_tmp_events_thread(void) {
+static void update_room_climate(const struct Room *room, uint32_t temp_scaled_value, uint32_t hum_scaled_value) {
+    history_add_sample(room->room_id, temp_scaled_value, hum_scaled_value);
 
-    struct Room **rooms = get_all_rooms();
+    process_climate_sample(room, temp_scaled_value, hum_scaled_value);
+}
 
-    while (1) {
+/* Sensor sampling runs on fixed deadlines instead of sleeping between rooms.
+ * Each job owns a delayable work item on the sensor work queue and is
+ * rescheduled on its own period grid, so the sampling period does not drift
+ * and does not grow with the number of rooms.
+ */
+struct sensor_job {
+    struct k_work_delayable work;
+    void (*read)(struct sensor_job *job);
+    const struct Room *room;                   // Room of a DHT11 job, NULL for the hs300x batch
+    uint32_t period_ms;                        // Sampling period
+    uint32_t min_interval_ms;                  // Minimum time between two reads of the sensor
+    int64_t next_deadline;                     // Uptime (ms) the next read is due
+    int64_t last_read;                         // Uptime (ms) the last read finished
+};
+
+static void read_hs300x_job(struct sensor_job *job) {
+    // One batch for all hs300x sensors, their bus latency overlaps instead of adding up
+    hs300x_read_all();
+
+    for (int i = 0; i < ROOM_COUNT; i++) {
+        const struct Room *room = get_room_by_id(i);
+        uint32_t temp_scaled_value = 0;
+        uint32_t hum_scaled_value = 0;
+
+        if (room->temp_dht11 != NULL || room->hs300x == NULL) {
+            continue;
+        }
+        if (read_temp_and_hum(room, &temp_scaled_value, &hum_scaled_value) == 0) {
+            update_room_climate(room, temp_scaled_value, hum_scaled_value);
+        }
+    }
+}
 
-        for (int i = 0; i < STRUCT_ROOM_COUNT; i++) {
+static void read_dht11_job(struct sensor_job *job) {
+    uint32_t temp_scaled_value = 0;
+    uint32_t hum_scaled_value = 0;
 
-            uint32_t temp_scaled_value = 0;
-            uint32_t hum_scaled_value = 0;
-            if (rooms[i]->temp_dht11 != NULL) {
-                int res = read_temp_and_hum_dht11(rooms[i], &temp_scaled_value, &hum_scaled_value);
-                k_sleep(K_SECONDS(2));
-                if (res < 0) {
-                    LOG_ERR("Error reading DHT11 sensor for room %d", rooms[i]->room_id);
-                    continue;
-                }
+    if (read_temp_and_hum_dht11(job->room, &temp_scaled_value, &hum_scaled_value) < 0) {
+        LOG_ERR("Error reading DHT11 sensor for room %d", job->room->room_id);
+        return;
+    }
+    update_room_climate(job->room, temp_scaled_value, hum_scaled_value);
+}
 
-            } else {
-                read_temp_and_hum(rooms[i], &temp_scaled_value, &hum_scaled_value);
-            }
+static struct sensor_job sensor_jobs[ROOM_COUNT + 1];
+static size_t sensor_job_count;
 
-            if (temp_scaled_value != rooms[i]->temp_sensor_value ||
-                hum_scaled_value != rooms[i]->hum_sensor_value) {
-                register_new_event(rooms[i], temp_scaled_value, HEAT_EV, true);
-                register_new_event(rooms[i], hum_scaled_value, HUM_EV, true);
-                rooms[i]->temp_sensor_value = temp_scaled_value;
-                rooms[i]->hum_sensor_value = hum_scaled_value;
-            }
-            
-            process_temperature_control(rooms[i]);
-        }
+K_THREAD_STACK_DEFINE(sensor_wq_stack, STACKSIZE);
+static struct k_work_q sensor_wq;
+
+static void sensor_job_handler(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct sensor_job *job = CONTAINER_OF(dwork, struct sensor_job, work);
 
-        k_sleep(K_SECONDS(10));
+    job->read(job);
+    job->last_read = k_uptime_get();
+
+    // Stay on the period grid, a deadline missed by a slow read is skipped rather than caught up
+    do {
+        job->next_deadline += job->period_ms;
+    } while (job->next_deadline <= job->last_read);
+
+    int64_t due = MAX(job->next_deadline, job->last_read + job->min_interval_ms);
+    k_work_schedule_for_queue(&sensor_wq, &job->work, K_TIMEOUT_ABS_MS(due));
+}
+
+static void sensor_job_add(void (*read)(struct sensor_job *job), const struct Room *room,
+                           uint32_t period_ms, uint32_t min_interval_ms, int64_t first_deadline) {
+    struct sensor_job *job = &sensor_jobs[sensor_job_count++];
+
+    job->read = read;
+    job->room = room;
+    job->period_ms = period_ms;
+    job->min_interval_ms = min_interval_ms;
+    job->next_deadline = first_deadline;
+    k_work_init_delayable(&job->work, sensor_job_handler);
+    k_work_schedule_for_queue(&sensor_wq, &job->work, K_TIMEOUT_ABS_MS(first_deadline));
+}
+
+static void sensor_scheduler_start(void) {
+    const struct k_work_queue_config cfg = { .name = "listening_tmp" };
+    int64_t now = k_uptime_get();
+
+    k_work_queue_start(&sensor_wq, sensor_wq_stack, K_THREAD_STACK_SIZEOF(sensor_wq_stack),
+                       PRIORITY, &cfg);
+
+    sensor_job_add(read_hs300x_job, NULL, CONFIG_SMARTHOME_SENSOR_PERIOD_MS, 0, now);
+
+    // Rooms sharing a DHT11 run on the same deadline, the first one fetches and the rest hit the cache
+    for (int i = 0; i < ROOM_COUNT; i++) {
+        const struct Room *room = get_room_by_id(i);
+
+        if (room->temp_dht11 == NULL) {
+            continue;
+        }
+        sensor_job_add(read_dht11_job, room, CONFIG_SMARTHOME_SENSOR_PERIOD_MS,
+                       CONFIG_SMARTHOME_DHT11_MIN_INTERVAL_MS, now);
     }
 }
 
+static atomic_t events_applied;
+static atomic_t events_coalesced;
+
+/* Only written by the executor thread */
+static struct {
+    uint32_t actuations;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} switch_latency;
+
+void get_executor_stats(struct executor_stats *stats) {
+    stats->applied = atomic_get(&events_applied);
+    stats->coalesced = atomic_get(&events_coalesced);
+    stats->switch_actuations = switch_latency.actuations;
+    stats->switch_last_us = switch_latency.last_us;
+    stats->switch_max_us = switch_latency.max_us;
+    stats->switch_total_us = switch_latency.total_us;
+}
+
+static void record_switch_latency(uint32_t press_cycles) {
+    uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - press_cycles);
+
+    switch_latency.actuations++;
+    switch_latency.last_us = latency_us;
+    switch_latency.max_us = MAX(switch_latency.max_us, latency_us);
+    switch_latency.total_us += latency_us;
+}
+
+/* One slot per actuator, every pending event holds a pool block so this can't overflow.
+ * Only the executor thread touches them, they are static to keep them off its stack.
+ */
+static struct Event *pending[CONFIG_SMARTHOME_EVENT_POOL_SIZE];
+static uint32_t dequeued_cycles[CONFIG_SMARTHOME_EVENT_POOL_SIZE];
+
 void execut_events_thread(void) {
     while (1) {
+        size_t pending_count = 0;
+        struct Event *registered_event = event_get(K_FOREVER);
+
+        // Drain everything queued so far, keeping only the newest value per actuator
+        while (registered_event != NULL) {
+            latency_record(LATENCY_EVENT_QUEUE, registered_event->created_cycles);
+
+            size_t i;
+            for (i = 0; i < pending_count; i++) {
+                if (pending[i]->ctx == registered_event->ctx) {
+                    break;
+                }
+            }
 
-        struct Event *registered_event = k_fifo_get(&events_fifo,
-							   K_FOREVER);
-        registered_event->action(
-            registered_event->ctx,
-            registered_event->value
-        );
-        k_free(registered_event);
+            if (i < pending_count) {
+                event_free(pending[i]);
+                atomic_inc(&events_coalesced);
+            } else {
+                pending_count++;
+            }
+            pending[i] = registered_event;
+            dequeued_cycles[i] = latency_stamp();
 
-        k_msleep(SLEEP_TIME_MS);
+            registered_event = event_get(K_NO_WAIT);
+        }
+
+        for (size_t i = 0; i < pending_count; i++) {
+            pending[i]->action(
+                pending[i]->ctx,
+                pending[i]->value
+            );
+            latency_record(LATENCY_EVENT_ACTION, dequeued_cycles[i]);
+            latency_record(LATENCY_EVENT_TOTAL, pending[i]->origin_cycles);
+            if (pending[i]->input_cycles != 0) {
+                record_switch_latency(pending[i]->input_cycles);
+            }
+            event_free(pending[i]);
+            atomic_inc(&events_applied);
+        }
     }
 }
 
@@ -111,6 +343,13 @@ int main(void)
         return 0;
     }
 
+    // Saved setpoints must be in place before the first sample reaches the control loop
+    room_settings_load();
+    room_controller_start();
+
+    sensor_scheduler_start();
+    light_switches_start();
+
     int ret = 0;
     ret = http_server_start();
     if (ret) {
@@ -132,9 +371,5 @@ int main(void)
 }
 
 // --- Thread definitions ---
-K_THREAD_DEFINE(listening_id, STACKSIZE, listening_switch_events_thread, NULL, NULL, NULL,
-                PRIORITY, 0, 0);
 K_THREAD_DEFINE(execut_id, STACKSIZE, execut_events_thread, NULL, NULL, NULL,
                 PRIORITY, 0, 0);
-K_THREAD_DEFINE(listening_tmp_id, STACKSIZE, listening_tmp_events_thread, NULL, NULL, NULL,
-                PRIORITY, 0, 0);
\ No newline at end of file
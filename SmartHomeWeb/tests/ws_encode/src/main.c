@@ -0,0 +1,161 @@
+#include <zephyr/ztest.h>
+#include <zephyr/data/json.h>
+#include <string.h>
+
+#include "WsEncode.h"
+
+/* The specialized encoders must produce byte for byte what json_obj_encode_buf()
+ * produces with the message descriptors, over the whole int32 range.
+ */
+static const int32_t ids[] = { 0, 1, 255, INT32_MAX, INT32_MIN };
+static const int32_t values[] = {
+	0, 1, -1, 9, 10, -10, 90, 100, 2150, 2200, 4100, -550, -2000,
+	INT16_MIN, INT16_MAX, 1000000000, -1000000000, INT32_MAX, INT32_MIN, INT32_MIN + 1,
+};
+
+#define BENCH_ITERATIONS 1000
+
+/* Longest message: {"room_id":-2147483648,"temp_value":-2147483648,"hum_value":-2147483648} */
+#define MAX_MESSAGE_LEN 72
+
+static char generic_buf[MAX_MESSAGE_LEN + 1];
+static uint8_t fast_buf[MAX_MESSAGE_LEN];
+
+/* Encodes data through its descriptor and checks the fast encoder wrote the same bytes */
+#define CHECK_ENCODER(descr, data, fast_call)                                           \
+	do {                                                                            \
+		int len;                                                                \
+		zassert_ok(json_obj_encode_buf(descr, ARRAY_SIZE(descr), &(data),       \
+					       generic_buf, sizeof(generic_buf)));     \
+		len = fast_call;                                                        \
+		zassert_equal(len, strlen(generic_buf), "%s: length %d", generic_buf, len); \
+		zassert_mem_equal(fast_buf, generic_buf, len, "expected %s", generic_buf); \
+	} while (0)
+
+ZTEST(ws_encode, test_room_light)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ids); i++) {
+		for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+			struct room_light_command msg = { .room_id = ids[i], .light_value = values[j] };
+
+			CHECK_ENCODER(room_light_command_descr, msg,
+				      ws_encode_room_light(fast_buf, sizeof(fast_buf), msg.room_id,
+							   msg.light_value));
+		}
+	}
+}
+
+ZTEST(ws_encode, test_room_temp_read)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ids); i++) {
+		for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+			for (size_t k = 0; k < ARRAY_SIZE(values); k++) {
+				struct room_temp_read_command msg = {
+					.room_id = ids[i],
+					.temp_value = values[j],
+					.hum_value = values[k],
+				};
+
+				CHECK_ENCODER(room_temp_command_descr, msg,
+					      ws_encode_room_temp_read(fast_buf, sizeof(fast_buf),
+								       msg.room_id, msg.temp_value,
+								       msg.hum_value));
+			}
+		}
+	}
+}
+
+ZTEST(ws_encode, test_room_temp_set)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ids); i++) {
+		for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+			struct room_temp_set_command msg = {
+				.room_id = ids[i],
+				.setpoint_temp_value = values[j],
+			};
+
+			CHECK_ENCODER(room_temp_set_command_descr, msg,
+				      ws_encode_room_temp_set(fast_buf, sizeof(fast_buf), msg.room_id,
+							      msg.setpoint_temp_value));
+		}
+	}
+}
+
+ZTEST(ws_encode, test_room_temp_heat_relay)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ids); i++) {
+		for (int relay = 0; relay <= 1; relay++) {
+			struct room_temp_heat_relay_command msg = {
+				.room_id = ids[i],
+				.heat_relay_state = relay,
+			};
+
+			CHECK_ENCODER(room_temp_heat_relay_command_descr, msg,
+				      ws_encode_room_temp_heat_relay(fast_buf, sizeof(fast_buf),
+								     msg.room_id, msg.heat_relay_state));
+		}
+	}
+}
+
+ZTEST(ws_encode, test_short_buffer)
+{
+	// Every encoder needs room for its longest message, whatever the values are
+	zassert_equal(ws_encode_room_light(fast_buf, 48, 1, 0), -ENOMEM);
+	zassert_equal(ws_encode_room_light(fast_buf, 49, INT32_MIN, INT32_MIN), 49);
+	zassert_equal(ws_encode_room_temp_read(fast_buf, 71, 1, 0, 0), -ENOMEM);
+	zassert_equal(ws_encode_room_temp_read(fast_buf, 72, INT32_MIN, INT32_MIN, INT32_MIN), 72);
+	zassert_equal(ws_encode_room_temp_set(fast_buf, 56, 1, 0), -ENOMEM);
+	zassert_equal(ws_encode_room_temp_set(fast_buf, 57, INT32_MIN, INT32_MIN), 57);
+	zassert_equal(ws_encode_room_temp_heat_relay(fast_buf, 47, 1, 0), -ENOMEM);
+	zassert_equal(ws_encode_room_temp_heat_relay(fast_buf, 48, INT32_MIN, false), 48);
+}
+
+/* Reports cycles per message of both paths, the figures are informative only */
+#define BENCH_ENCODER(label, descr, data, fast_call)                                    \
+	do {                                                                            \
+		uint32_t start = k_cycle_get_32();                                      \
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {                            \
+			json_obj_encode_buf(descr, ARRAY_SIZE(descr), &(data),          \
+					    generic_buf, sizeof(generic_buf));          \
+			sink += strlen(generic_buf);                                    \
+		}                                                                       \
+		uint32_t generic = (k_cycle_get_32() - start) / BENCH_ITERATIONS;       \
+		start = k_cycle_get_32();                                               \
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {                            \
+			sink += fast_call;                                              \
+		}                                                                       \
+		uint32_t fast = (k_cycle_get_32() - start) / BENCH_ITERATIONS;          \
+		TC_PRINT("%-20s json_obj_encode_buf %6u cyc/msg | specialized %6u cyc/msg\n", \
+			 label, generic, fast);                                         \
+	} while (0)
+
+ZTEST(ws_encode, test_cycles)
+{
+	volatile size_t sink = 0;
+
+	struct room_light_command light = { .room_id = 1, .light_value = 90 };
+	BENCH_ENCODER("room_light", room_light_command_descr, light,
+		      ws_encode_room_light(fast_buf, sizeof(fast_buf), light.room_id,
+					   light.light_value));
+
+	struct room_temp_read_command temp = { .room_id = 1, .temp_value = -550, .hum_value = 4100 };
+	BENCH_ENCODER("room_temp_read", room_temp_command_descr, temp,
+		      ws_encode_room_temp_read(fast_buf, sizeof(fast_buf), temp.room_id,
+					       temp.temp_value, temp.hum_value));
+
+	struct room_temp_set_command setpoint = { .room_id = 1, .setpoint_temp_value = 2200 };
+	BENCH_ENCODER("room_temp_set", room_temp_set_command_descr, setpoint,
+		      ws_encode_room_temp_set(fast_buf, sizeof(fast_buf), setpoint.room_id,
+					      setpoint.setpoint_temp_value));
+
+	struct room_temp_heat_relay_command relay = { .room_id = 1, .heat_relay_state = false };
+	BENCH_ENCODER("room_temp_heat_relay", room_temp_heat_relay_command_descr, relay,
+		      ws_encode_room_temp_heat_relay(fast_buf, sizeof(fast_buf), relay.room_id,
+						     relay.heat_relay_state));
+
+	TC_PRINT("%d iterations, %u cycles per second\n", BENCH_ITERATIONS,
+		 sys_clock_hw_cycles_per_sec());
+	zassert_true(sink > 0);
+}
+
+ZTEST_SUITE(ws_encode, NULL, NULL, NULL, NULL, NULL);